@@ -0,0 +1,502 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <unistd.h>
+#include "filesystem.h"
+#include "utility.h"
+
+/*
+BENCHMARKS
+Drives FileSystem directly on scratch images in a temporary directory and
+reports ops/sec, latency percentiles and bytes/sec for every operation.
+--json writes the same results in a machine-readable form so runs from
+different commits can be compared.
+*/
+
+namespace {
+
+struct Result {
+    std::string name;
+    std::vector<double> latencies; // Seconds per operation
+    uint64_t bytes = 0;            // Bytes moved, for operations that move data
+    double seconds = 0;            // Wall time over all operations
+};
+
+std::vector<Result> results;
+std::ofstream null_stream("/dev/null");
+std::string scratch_directory;
+
+// Time each call of op separately. FileSystem reports on std::cout, which
+// is silenced while the operations run; errors still go to std::cerr.
+template <typename Operation>
+Result& measure(const std::string& name, uint32_t count, uint64_t bytes_per_op, Operation op) {
+    results.push_back(Result());
+    Result& result = results.back();
+    result.name = name;
+    result.latencies.reserve(count);
+
+    std::streambuf* saved = std::cout.rdbuf(null_stream.rdbuf());
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (uint32_t i = 0; i < count; ++i) {
+        std::chrono::steady_clock::time_point op_start = std::chrono::steady_clock::now();
+        op(i);
+        result.latencies.push_back(std::chrono::duration<double>(std::chrono::steady_clock::now() - op_start).count());
+    }
+    result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cout.rdbuf(saved);
+
+    result.bytes = bytes_per_op * count;
+    return result;
+}
+
+double percentile(const std::vector<double>& sorted, double p) {
+    if (sorted.empty()) {
+        return 0;
+    }
+    size_t index = std::min(sorted.size() - 1, static_cast<size_t>(p * sorted.size()));
+    return sorted[index];
+}
+
+std::string scratch(const std::string& name) {
+    return scratch_directory + "/" + name;
+}
+
+// Create a host file of the given size for write to copy in
+std::string make_host_file(uint32_t size) {
+    std::string path = scratch("host_" + std::to_string(size));
+    std::ofstream ofs(path, std::ios::binary);
+    std::vector<char> data(size);
+    for (uint32_t i = 0; i < size; ++i) {
+        data[i] = static_cast<char>('a' + i % 26);
+    }
+    ofs.write(data.data(), size);
+    return path;
+}
+
+void remove_image(const std::string& image) {
+    std::remove(image.c_str());
+    std::remove((image + ".journal").c_str());
+}
+
+// Build a chain of nested directories, each with 'width' siblings, and
+// return the path of the deepest one
+std::string build_tree(FileSystem& fs, uint32_t depth, uint32_t width) {
+    std::streambuf* saved = std::cout.rdbuf(null_stream.rdbuf());
+    std::string path;
+    for (uint32_t level = 0; level < depth; ++level) {
+        for (uint32_t sibling = 0; sibling < width; ++sibling) {
+            fs.mkdir(path + "/d" + std::to_string(sibling));
+        }
+        path += "/d" + std::to_string(width - 1);
+    }
+    std::cout.rdbuf(saved);
+    return path;
+}
+
+void bench_mkdir(uint32_t scale) {
+    std::string image = scratch("mkdir.data");
+    FileSystem fs(image, 4096, 1024);
+
+    uint32_t fan_out = 64 * scale;
+    measure("mkdir fan-out " + std::to_string(fan_out), fan_out, 0, [&](uint32_t i) {
+        fs.mkdir("/f" + std::to_string(i));
+    });
+
+    uint32_t depth = 32;
+    std::string path;
+    measure("mkdir depth " + std::to_string(depth), depth, 0, [&](uint32_t) {
+        path += "/n";
+        fs.mkdir(path);
+    });
+    remove_image(image);
+}
+
+void bench_write_read_del(uint32_t scale) {
+    std::string image = scratch("data.data");
+    FileSystem fs(image, 65000, 1024);
+    std::string out = scratch("out");
+
+    // Small, medium and large files, sized so every class fits together
+    const uint32_t sizes[] = {512, 4096, 64 * 1024, 1024 * 1024};
+    const uint32_t counts[] = {256, 128, 32, 4};
+    for (int c = 0; c < 4; ++c) {
+        uint32_t size = sizes[c];
+        uint32_t count = counts[c] * scale;
+        std::string host_file = make_host_file(size);
+        std::string prefix = "/s" + std::to_string(size) + "_";
+        std::string label = std::to_string(size) + "B";
+
+        measure("write " + label, count, size, [&](uint32_t i) {
+            fs.write(prefix + std::to_string(i), host_file);
+        });
+        measure("read " + label, count, size, [&](uint32_t i) {
+            fs.read(prefix + std::to_string(i), out);
+        });
+        measure("del " + label, count, 0, [&](uint32_t i) {
+            fs.del(prefix + std::to_string(i));
+        });
+        std::remove(host_file.c_str());
+    }
+    std::remove(out.c_str());
+    remove_image(image);
+}
+
+// Moving a tree of files out of and into an image as one tar stream,
+// against a read or write of a host file per file
+void bench_tar(uint32_t scale) {
+    std::string image = scratch("tar.data");
+    FileSystem fs(image, 65000, 1024);
+    const uint32_t file_size = 16 * 1024;
+    const uint32_t files = 128;
+    std::string host_file = make_host_file(file_size);
+    std::string out = scratch("out");
+
+    std::streambuf* saved = std::cout.rdbuf(null_stream.rdbuf());
+    fs.mkdir("/src");
+    for (uint32_t i = 0; i < files; ++i) {
+        fs.write("/src/f" + std::to_string(i), host_file);
+    }
+    std::cout.rdbuf(saved);
+
+    uint64_t tree_bytes = static_cast<uint64_t>(files) * file_size;
+    std::string archive;
+    // tar_out puts its summary on std::cerr, as the archive owns std::cout.
+    // Hold it back while timing and only pass on the errors.
+    std::ostringstream tar_messages;
+    std::streambuf* saved_errors = std::cerr.rdbuf(tar_messages.rdbuf());
+    measure("tar-out 128x16KB", scale, tree_bytes, [&](uint32_t) {
+        std::ostringstream os;
+        fs.tar_out("/src", os);
+        archive = os.str();
+    });
+    std::cerr.rdbuf(saved_errors);
+    std::istringstream tar_lines(tar_messages.str());
+    std::string line;
+    while (std::getline(tar_lines, line)) {
+        if (line.compare(0, 6, "Error:") == 0) {
+            std::cerr << line << std::endl;
+        }
+    }
+    measure("read 128x16KB to host files", scale, tree_bytes, [&](uint32_t) {
+        for (uint32_t i = 0; i < files; ++i) {
+            fs.read("/src/f" + std::to_string(i), out);
+        }
+    });
+    measure("tar-in 128x16KB", scale, tree_bytes, [&](uint32_t i) {
+        std::istringstream is(archive);
+        fs.mkdir("/t" + std::to_string(i));
+        fs.tar_in("/t" + std::to_string(i), is);
+    });
+    measure("write 128x16KB from host files", scale, tree_bytes, [&](uint32_t i) {
+        fs.mkdir("/w" + std::to_string(i));
+        for (uint32_t f = 0; f < files; ++f) {
+            fs.write("/w" + std::to_string(i) + "/f" + std::to_string(f), host_file);
+        }
+    });
+    std::remove(host_file.c_str());
+    std::remove(out.c_str());
+    remove_image(image);
+}
+
+// Checksumming, copying, and filling and draining a chain of 1 MB of
+// blocks with the generic kernels and with the ones specialized for the
+// block size
+void bench_block_kernels(uint32_t scale) {
+    const uint32_t area_size = 1024 * 1024;
+    std::vector<char> source(area_size);
+    std::vector<char> destination(area_size);
+    for (uint32_t i = 0; i < area_size; ++i) {
+        source[i] = static_cast<char>(i * 131 + i / 977);
+    }
+
+    for (uint32_t block_size : {512u, 1024u, 4096u}) {
+        // A 1 MB file laid out as one chain over a resident block area
+        uint32_t chain_length = area_size / block_size;
+        BufferCache cache;
+        cache.initMemory(chain_length + 1, block_size);
+        std::vector<uint16_t> fat(chain_length + 1);
+        std::vector<uint32_t> checksums(chain_length + 1);
+        std::vector<uint32_t> generations(chain_length + 1);
+        for (uint32_t block = 1; block <= chain_length; ++block) {
+            fat[block] = block < chain_length ? block + 1 : FAT_EOC;
+        }
+        ChainState state{&cache, fat.data(), static_cast<uint32_t>(fat.size()), checksums.data(), generations.data(), 1, 0};
+        std::string file_data(source.begin(), source.end());
+
+        for (bool specialized : {false, true}) {
+            const BlockKernels& kernels = select_block_kernels(block_size, specialized);
+            std::string label = std::to_string(block_size) + "B blocks " + (specialized ? "specialized" : "generic");
+            measure("checksum 1MB " + label, 64 * scale, area_size, [&](uint32_t) {
+                for (uint32_t offset = 0; offset < area_size; offset += block_size) {
+                    kernels.checksum(source.data() + offset, block_size);
+                }
+            });
+            measure("copy 1MB " + label, 64 * scale, area_size, [&](uint32_t) {
+                for (uint32_t offset = 0; offset < area_size; offset += block_size) {
+                    kernels.copy(destination.data() + offset, source.data() + offset, block_size);
+                }
+            });
+            measure("fill chain 1MB " + label, 64 * scale, area_size, [&](uint32_t) {
+                std::istringstream is(file_data);
+                kernels.fill_chain(state, 1, is, area_size, block_size);
+            });
+            measure("drain chain 1MB " + label, 64 * scale, area_size, [&](uint32_t) {
+                std::ostringstream os;
+                kernels.drain_chain(state, 1, os, area_size, block_size);
+            });
+        }
+    }
+}
+
+// Growing a log by small appends, against rewriting it with del and write
+void bench_append(uint32_t scale) {
+    std::string image = scratch("append.data");
+    FileSystem fs(image, 65000, 1024);
+    const uint32_t log_size = 256 * 1024;
+    std::string log_file = make_host_file(log_size);
+    std::string record_file = make_host_file(512);
+
+    std::streambuf* saved = std::cout.rdbuf(null_stream.rdbuf());
+    fs.write("/log", log_file);
+    fs.write("/rewritten", log_file);
+    std::cout.rdbuf(saved);
+
+    uint32_t count = 64 * scale;
+    measure("append 512B to 256KB", count, 512, [&](uint32_t) {
+        fs.append("/log", record_file);
+    });
+    measure("del+write 256KB", count, log_size, [&](uint32_t) {
+        fs.del("/rewritten");
+        fs.write("/rewritten", log_file);
+    });
+    measure("truncate 256KB by 512B", count, 0, [&](uint32_t i) {
+        fs.fs_truncate("/log", log_size + (count - 1 - i) * 512);
+    });
+    std::remove(log_file.c_str());
+    std::remove(record_file.c_str());
+    remove_image(image);
+}
+
+void bench_find_directory(uint32_t scale) {
+    const uint32_t depths[] = {1, 8, 32};
+    const uint32_t widths[] = {1, 64, 512};
+    for (uint32_t depth : depths) {
+        for (uint32_t width : widths) {
+            if (depth * width > 4096) {
+                continue;
+            }
+            std::string image = scratch("find.data");
+            FileSystem fs(image, 4096, 1024);
+            std::string deepest = build_tree(fs, depth, width);
+
+            uint32_t lookups = 2000 * scale;
+            measure("findDirectory depth " + std::to_string(depth) + " width " + std::to_string(width), lookups, 0, [&](uint32_t) {
+                if (fs.findDirectory(deepest) == nullptr) {
+                    std::cerr << "Error: Lookup failed: " << deepest << std::endl;
+                }
+            });
+            remove_image(image);
+        }
+    }
+}
+
+// Fill images of several sizes to about half their capacity, then time
+// dumpe2fs, saving and loading them
+void bench_images(uint32_t scale) {
+    const uint32_t image_blocks[] = {4096, 16384, 65000};
+    std::string host_file = make_host_file(16 * 1024);
+    for (uint32_t total_blocks : image_blocks) {
+        std::string image = scratch("image.data");
+        uint64_t image_bytes = static_cast<uint64_t>(total_blocks) * 1024;
+        std::string label = std::to_string(total_blocks) + " blocks";
+        {
+            FileSystem fs(image, total_blocks, 1024);
+            std::streambuf* saved = std::cout.rdbuf(null_stream.rdbuf());
+            uint32_t files = total_blocks / 2 / 16;
+            for (uint32_t i = 0; i < files; ++i) {
+                if (i % 64 == 0) {
+                    fs.mkdir("/g" + std::to_string(i / 64));
+                }
+                fs.write("/g" + std::to_string(i / 64) + "/f" + std::to_string(i), host_file);
+            }
+            std::cout.rdbuf(saved);
+
+            measure("dumpe2fs " + label, 20 * scale, 0, [&](uint32_t) {
+                fs.dumpe2fs();
+            });
+            measure("save_filesystem " + label, 5 * scale, image_bytes, [&](uint32_t) {
+                fs.save_filesystem(image);
+            });
+        }
+        measure("load_filesystem " + label, 5 * scale, image_bytes, [&](uint32_t) {
+            FileSystem loaded(image);
+        });
+        remove_image(image);
+    }
+    std::remove(host_file.c_str());
+}
+
+// Loading an image whose size is dominated by directory metadata
+void bench_metadata(uint32_t scale) {
+    std::string image = scratch("metadata.data");
+    const uint32_t entries = 20000;
+    {
+        FileSystem fs(image, 4096, 1024);
+        std::streambuf* saved = std::cout.rdbuf(null_stream.rdbuf());
+        for (uint32_t i = 0; i < entries; ++i) {
+            std::string group = "/m" + std::to_string(i / 100);
+            fs.mkdir(i % 100 == 0 ? group : group + "/e" + std::to_string(i));
+        }
+        fs.save_filesystem(image);
+        std::cout.rdbuf(saved);
+    }
+    measure("load_filesystem " + std::to_string(entries) + " entries", 10 * scale, 0, [&](uint32_t) {
+        FileSystem loaded(image);
+    });
+    remove_image(image);
+}
+
+// Disk-resident reads, writes and scrub through a small cache, once with
+// pread/pwrite and once with io_uring
+void bench_disk_resident(uint32_t scale) {
+    std::string image = scratch("cache.data");
+    std::string out = scratch("out");
+    const uint32_t file_size = 256 * 1024;
+    const uint32_t files = 64;
+    std::string host_file = make_host_file(file_size);
+    {
+        FileSystem fs(image, 65000, 1024);
+        std::streambuf* saved = std::cout.rdbuf(null_stream.rdbuf());
+        for (uint32_t i = 0; i < files; ++i) {
+            fs.write("/f" + std::to_string(i), host_file);
+        }
+        fs.save_filesystem(image);
+        std::cout.rdbuf(saved);
+    }
+
+    for (IOBackend backend : {BACKEND_PREAD, BACKEND_IO_URING}) {
+        std::string label = backend == BACKEND_IO_URING ? " io_uring" : " pread";
+        std::streambuf* saved = std::cout.rdbuf(null_stream.rdbuf());
+        FileSystem fs(image, 256, backend);
+        std::cout.rdbuf(saved);
+
+        measure("cached read 256KB" + label, files * scale, file_size, [&](uint32_t i) {
+            fs.read("/f" + std::to_string(i % files), out);
+        });
+        measure("cached write 256KB" + label, files, file_size, [&](uint32_t i) {
+            fs.write("/w" + std::to_string(i), host_file);
+        });
+        measure("cached scrub" + label, scale, static_cast<uint64_t>(2 * files) * file_size, [&](uint32_t) {
+            fs.scrub(4);
+        });
+    }
+    std::remove(host_file.c_str());
+    std::remove(out.c_str());
+    remove_image(image);
+}
+
+void print_results() {
+    std::cout << std::left << std::setw(36) << "Benchmark"
+              << std::right << std::setw(8) << "Ops"
+              << std::setw(12) << "Ops/sec"
+              << std::setw(11) << "p50 us"
+              << std::setw(11) << "p90 us"
+              << std::setw(11) << "p99 us"
+              << std::setw(11) << "max us"
+              << std::setw(12) << "MB/sec" << std::endl;
+
+    for (Result& result : results) {
+        std::vector<double> sorted = result.latencies;
+        std::sort(sorted.begin(), sorted.end());
+        std::cout << std::left << std::setw(36) << result.name
+                  << std::right << std::setw(8) << sorted.size()
+                  << std::fixed << std::setprecision(0) << std::setw(12) << sorted.size() / result.seconds
+                  << std::setprecision(1)
+                  << std::setw(11) << percentile(sorted, 0.50) * 1e6
+                  << std::setw(11) << percentile(sorted, 0.90) * 1e6
+                  << std::setw(11) << percentile(sorted, 0.99) * 1e6
+                  << std::setw(11) << (sorted.empty() ? 0 : sorted.back() * 1e6);
+        if (result.bytes > 0) {
+            std::cout << std::setw(12) << result.bytes / result.seconds / (1024 * 1024);
+        }
+        std::cout << std::endl;
+    }
+}
+
+void write_json(const std::string& json_file) {
+    std::ofstream ofs(json_file);
+    if (!ofs.is_open()) {
+        std::cerr << "Error: Unable to open results file: " << json_file << std::endl;
+        return;
+    }
+
+    ofs << "[" << std::endl;
+    for (size_t i = 0; i < results.size(); ++i) {
+        Result& result = results[i];
+        std::vector<double> sorted = result.latencies;
+        std::sort(sorted.begin(), sorted.end());
+        ofs << "  {\"name\": \"" << result.name << "\""
+            << ", \"ops\": " << sorted.size()
+            << ", \"seconds\": " << result.seconds
+            << ", \"ops_per_sec\": " << sorted.size() / result.seconds
+            << ", \"p50_us\": " << percentile(sorted, 0.50) * 1e6
+            << ", \"p90_us\": " << percentile(sorted, 0.90) * 1e6
+            << ", \"p99_us\": " << percentile(sorted, 0.99) * 1e6
+            << ", \"max_us\": " << (sorted.empty() ? 0 : sorted.back() * 1e6)
+            << ", \"bytes\": " << result.bytes
+            << ", \"bytes_per_sec\": " << result.bytes / result.seconds
+            << "}" << (i + 1 < results.size() ? "," : "") << std::endl;
+    }
+    ofs << "]" << std::endl;
+}
+
+}
+
+
+int main(int argc, char* argv[]) {
+    uint32_t scale = 1;
+    std::string json_file;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--scale" && i + 1 < argc && parse_number(argv[i + 1], scale) && scale > 0) {
+            ++i;
+        } else if (arg == "--json" && i + 1 < argc) {
+            json_file = argv[++i];
+        } else {
+            std::cerr << "Usage: " << argv[0] << " [--scale <n>] [--json <results.json>]" << std::endl;
+            return 1;
+        }
+    }
+
+    char scratch_template[] = "/tmp/fsbenchXXXXXX";
+    if (mkdtemp(scratch_template) == nullptr) {
+        std::cerr << "Error: Unable to create a scratch directory." << std::endl;
+        return 1;
+    }
+    scratch_directory = scratch_template;
+
+    bench_mkdir(scale);
+    bench_write_read_del(scale);
+    bench_append(scale);
+    bench_block_kernels(scale);
+    bench_tar(scale);
+    bench_find_directory(scale);
+    bench_images(scale);
+    bench_metadata(scale);
+    bench_disk_resident(scale);
+    rmdir(scratch_directory.c_str());
+
+    print_results();
+    if (!json_file.empty()) {
+        write_json(json_file);
+        std::cout << "Results written to " << json_file << std::endl;
+    }
+    return 0;
+}
@@ -0,0 +1,256 @@
+#include "blockio.h"
+#include <stdexcept>
+#include <algorithm>
+#include <string>
+#include <cerrno>
+#include <cstring>
+#include <unistd.h>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define HAVE_IO_URING 1
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+#endif
+
+/*
+BLOCK I/O
+io_uring is driven through its raw syscalls, so no liburing is needed: the
+submission and completion rings are mapped once, each batch fills
+submission entries until queue_depth requests are in flight, and one
+io_uring_enter both submits them and waits for completions. Entries the
+kernel did not consume are offered again, short transfers are resubmitted
+for the remainder, and a failed request is only reported once every entry
+of its batch has completed, so no completion is left for the next batch.
+*/
+
+BlockIO::BlockIO()
+    : batches(0), requests_run(0), ring_fd(-1), queue_depth(1),
+      sq_ring(nullptr), cq_ring(nullptr), sqes(nullptr), sq_ring_size(0), cq_ring_size(0), sqes_size(0),
+      sq_head(nullptr), sq_tail(nullptr), sq_mask(nullptr), sq_array(nullptr),
+      cq_head(nullptr), cq_tail(nullptr), cq_mask(nullptr), cqes(nullptr) {
+}
+
+BlockIO::~BlockIO() {
+    closeRing();
+}
+
+void BlockIO::init(IOBackend backend, unsigned int queue_depth) {
+    closeRing();
+    this->queue_depth = std::max(1u, queue_depth);
+    if (backend == BACKEND_IO_URING && !setupRing(this->queue_depth)) {
+        closeRing();
+    }
+}
+
+void BlockIO::run(std::vector<BlockRequest>& requests) {
+    if (requests.empty()) {
+        return;
+    }
+    batches++;
+    requests_run += requests.size();
+    if (ring_fd >= 0) {
+        runRing(requests);
+    } else {
+        runSync(requests);
+    }
+}
+
+void BlockIO::runSync(std::vector<BlockRequest>& requests) {
+    for (BlockRequest& request : requests) {
+        uint32_t done = 0;
+        while (done < request.length) {
+            ssize_t result = request.write
+                ? pwrite(request.fd, request.data + done, request.length - done, request.offset + done)
+                : pread(request.fd, request.data + done, request.length - done, request.offset + done);
+            if (result < 0 && errno == EINTR) {
+                continue;
+            }
+            if (result <= 0) {
+                throw std::runtime_error(request.write ? "Block write failed" : "Block read failed");
+            }
+            done += result;
+        }
+    }
+}
+
+#ifdef HAVE_IO_URING
+
+bool BlockIO::setupRing(unsigned int entries) {
+    io_uring_params params;
+    std::memset(&params, 0, sizeof(params));
+    int fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (fd < 0) {
+        return false;
+    }
+    ring_fd = fd;
+
+    // IORING_OP_READ and IORING_OP_WRITE arrived together with this feature
+    if (!(params.features & IORING_FEAT_RW_CUR_POS)) {
+        return false;
+    }
+
+    sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_mmap) {
+        sq_ring_size = cq_ring_size = std::max(sq_ring_size, cq_ring_size);
+    }
+
+    sq_ring = mmap(nullptr, sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+    if (sq_ring == MAP_FAILED) {
+        sq_ring = nullptr;
+        return false;
+    }
+    if (single_mmap) {
+        cq_ring = sq_ring;
+    } else {
+        cq_ring = mmap(nullptr, cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+        if (cq_ring == MAP_FAILED) {
+            cq_ring = nullptr;
+            return false;
+        }
+    }
+    sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+    sqes = mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+        sqes = nullptr;
+        return false;
+    }
+
+    char* sq = static_cast<char*>(sq_ring);
+    char* cq = static_cast<char*>(cq_ring);
+    sq_head = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+    sq_tail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+    sq_mask = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+    sq_array = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+    cq_head = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+    cq_tail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+    cq_mask = reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+    cqes = cq + params.cq_off.cqes;
+
+    queue_depth = std::min(queue_depth, params.sq_entries);
+    return true;
+}
+
+void BlockIO::closeRing() {
+    if (sqes != nullptr) {
+        munmap(sqes, sqes_size);
+    }
+    if (cq_ring != nullptr && cq_ring != sq_ring) {
+        munmap(cq_ring, cq_ring_size);
+    }
+    if (sq_ring != nullptr) {
+        munmap(sq_ring, sq_ring_size);
+    }
+    sq_ring = cq_ring = sqes = nullptr;
+    if (ring_fd >= 0) {
+        close(ring_fd);
+        ring_fd = -1;
+    }
+}
+
+void BlockIO::runRing(std::vector<BlockRequest>& requests) {
+    std::vector<uint32_t> done(requests.size(), 0);
+    std::vector<size_t> pending; // Requests to (re)submit, taken from the back
+    for (size_t i = requests.size(); i-- > 0;) {
+        pending.push_back(i);
+    }
+
+    io_uring_sqe* sqe_array = static_cast<io_uring_sqe*>(sqes);
+    io_uring_cqe* cqe_array = static_cast<io_uring_cqe*>(cqes);
+    size_t completed = 0;
+    unsigned int in_flight = 0;   // Published entries whose completion is not reaped yet
+    unsigned int unsubmitted = 0; // Published entries the kernel has not consumed yet
+    const char* failure = nullptr;
+    while (in_flight > 0 || (failure == nullptr && completed < requests.size())) {
+        // Fill submission entries up to the queue depth. After a failure
+        // nothing new is queued; the loop only runs until every entry that
+        // refers to this batch has completed.
+        unsigned tail = *sq_tail;
+        while (failure == nullptr && in_flight < queue_depth && !pending.empty()) {
+            size_t index = pending.back();
+            pending.pop_back();
+            BlockRequest& request = requests[index];
+
+            unsigned slot = tail & *sq_mask;
+            io_uring_sqe* sqe = &sqe_array[slot];
+            std::memset(sqe, 0, sizeof(*sqe));
+            sqe->opcode = request.write ? IORING_OP_WRITE : IORING_OP_READ;
+            sqe->fd = request.fd;
+            sqe->addr = reinterpret_cast<uint64_t>(request.data + done[index]);
+            sqe->len = request.length - done[index];
+            sqe->off = request.offset + done[index];
+            sqe->user_data = index;
+            sq_array[slot] = slot;
+            tail++;
+            unsubmitted++;
+            in_flight++;
+        }
+        __atomic_store_n(sq_tail, tail, __ATOMIC_RELEASE);
+
+        // The kernel may consume fewer entries than offered (and then does
+        // not wait); the rest are offered again on the next pass
+        int result = syscall(__NR_io_uring_enter, ring_fd, unsubmitted, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+        if (result < 0 && errno != EINTR && errno != EAGAIN) {
+            // Entries of this batch may still complete later, so the ring
+            // cannot be trusted again; later batches use pread and pwrite
+            std::string message = std::string("io_uring_enter failed: ") + std::strerror(errno);
+            closeRing();
+            throw std::runtime_error(message);
+        }
+        if (result > 0) {
+            unsubmitted -= std::min<unsigned>(result, unsubmitted);
+        }
+
+        // Reap completions; short transfers go back to the pending list
+        unsigned head = *cq_head;
+        unsigned cq_end = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+        while (head != cq_end) {
+            io_uring_cqe* cqe = &cqe_array[head & *cq_mask];
+            size_t index = cqe->user_data;
+            int res = cqe->res;
+            head++;
+            in_flight--;
+
+            if (failure != nullptr) {
+                continue;
+            }
+            if (res == -EINTR || res == -EAGAIN) {
+                pending.push_back(index);
+                continue;
+            }
+            if (res <= 0) {
+                failure = requests[index].write ? "Block write failed" : "Block read failed";
+                continue;
+            }
+            done[index] += res;
+            if (done[index] < requests[index].length) {
+                pending.push_back(index);
+            } else {
+                completed++;
+            }
+        }
+        __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+    }
+    if (failure != nullptr) {
+        throw std::runtime_error(failure);
+    }
+}
+
+#else
+
+bool BlockIO::setupRing(unsigned int) {
+    return false;
+}
+
+void BlockIO::closeRing() {
+}
+
+void BlockIO::runRing(std::vector<BlockRequest>& requests) {
+    runSync(requests);
+}
+
+#endif
@@ -0,0 +1,68 @@
+#ifndef BLOCKIO_H
+#define BLOCKIO_H
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+// How BlockIO executes a batch
+enum IOBackend {
+    BACKEND_PREAD,   // One blocking pread/pwrite per request
+    BACKEND_IO_URING // Up to queue_depth requests in flight through io_uring
+};
+
+// One positioned read or write of a block-sized buffer
+struct BlockRequest {
+    int fd;
+    char* data;
+    uint32_t length;
+    uint64_t offset;
+    bool write;
+};
+
+// Executes batches of block I/O. With BACKEND_IO_URING (if supported by
+// the kernel) a batch is submitted through raw io_uring syscalls with up to
+// queue_depth requests in flight; otherwise, or if setup fails, each
+// request is a blocking pread/pwrite.
+class BlockIO {
+    public:
+        BlockIO();
+        ~BlockIO();
+
+        void init(IOBackend backend, unsigned int queue_depth);
+        bool usingIoUring() const { return ring_fd >= 0; }
+        unsigned int queueDepth() const { return queue_depth; }
+
+        // Run every request to completion; throws if one fails
+        void run(std::vector<BlockRequest>& requests);
+
+        uint64_t batches;
+        uint64_t requests_run;
+
+    private:
+        int ring_fd;
+        unsigned int queue_depth;
+
+        // Mapped ring state
+        void* sq_ring;
+        void* cq_ring;
+        void* sqes;
+        size_t sq_ring_size;
+        size_t cq_ring_size;
+        size_t sqes_size;
+        unsigned* sq_head;
+        unsigned* sq_tail;
+        unsigned* sq_mask;
+        unsigned* sq_array;
+        unsigned* cq_head;
+        unsigned* cq_tail;
+        unsigned* cq_mask;
+        void* cqes;
+
+        bool setupRing(unsigned int entries);
+        void closeRing();
+        void runSync(std::vector<BlockRequest>& requests);
+        void runRing(std::vector<BlockRequest>& requests);
+};
+
+#endif
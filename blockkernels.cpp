@@ -0,0 +1,210 @@
+#include "blockkernels.h"
+#include <algorithm>
+#include <cstring>
+#include <istream>
+#include <ostream>
+#include <vector>
+#include "buffercache.h"
+#include "crc32c.h"
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#define BLOCK_KERNELS_HAVE_SSE42 1
+#endif
+
+/*
+BLOCK KERNELS
+With the block size fixed, divisions become shifts and block copies become
+a fixed run of vector moves. The checksum gains the most: a single CRC32C
+stream waits on the latency of each crc32 instruction, so a fixed-size
+block is split into three equal lanes hashed side by side, and the lane
+results are combined with a shift table built once for that lane length.
+The chain kernels are instantiated with both the block size and the
+checksum as template arguments, so a file's whole block loop is one
+function with no per-block indirect calls.
+*/
+
+namespace {
+
+template <uint32_t BlockSize>
+uint32_t chain_blocks(uint32_t file_size, uint32_t block_size) {
+    const uint32_t size = BlockSize != 0 ? BlockSize : block_size;
+    return std::max(1u, (file_size + size - 1) / size);
+}
+
+template <uint32_t BlockSize>
+void copy_block(char* destination, const char* source, uint32_t block_size) {
+    std::memcpy(destination, source, BlockSize != 0 ? BlockSize : block_size);
+}
+
+template <uint32_t BlockSize>
+uint32_t checksum_block(const char* block, uint32_t block_size) {
+    return crc32c(block, BlockSize != 0 ? BlockSize : block_size);
+}
+
+#ifdef BLOCK_KERNELS_HAVE_SSE42
+inline uint64_t load_word(const char* data) {
+    uint64_t word;
+    std::memcpy(&word, data, sizeof(word));
+    return word;
+}
+
+// Feeding 'Bytes' zero bytes to a raw CRC state is linear in the state, so
+// it is tabulated per state byte from the images of the 32 state bits
+template <uint32_t Bytes>
+struct Crc32cShift {
+    uint32_t tables[4][256];
+
+    __attribute__((target("sse4.2")))
+    Crc32cShift() {
+        uint32_t images[32];
+        for (int bit = 0; bit < 32; ++bit) {
+            uint64_t crc = 1u << bit;
+            for (uint32_t i = 0; i < Bytes; i += 8) {
+                crc = _mm_crc32_u64(crc, 0);
+            }
+            images[bit] = static_cast<uint32_t>(crc);
+        }
+        for (int table = 0; table < 4; ++table) {
+            for (uint32_t value = 0; value < 256; ++value) {
+                uint32_t image = 0;
+                for (int bit = 0; bit < 8; ++bit) {
+                    if (value & (1u << bit)) {
+                        image ^= images[8 * table + bit];
+                    }
+                }
+                tables[table][value] = image;
+            }
+        }
+    }
+
+    uint32_t operator()(uint32_t crc) const {
+        return tables[0][crc & 0xFF] ^ tables[1][(crc >> 8) & 0xFF] ^ tables[2][(crc >> 16) & 0xFF] ^ tables[3][crc >> 24];
+    }
+};
+
+template <uint32_t BlockSize>
+__attribute__((target("sse4.2")))
+uint32_t checksum_block_sse42(const char* block, uint32_t) {
+    static_assert(BlockSize % 8 == 0 && BlockSize >= 24, "Lanes need whole words");
+    const uint32_t LANE = BlockSize / 24 * 8;
+    static const Crc32cShift<LANE> shift;
+
+    uint64_t a = 0xFFFFFFFF;
+    uint64_t b = 0;
+    uint64_t c = 0;
+    for (uint32_t i = 0; i < LANE; i += 8) {
+        a = _mm_crc32_u64(a, load_word(block + i));
+        b = _mm_crc32_u64(b, load_word(block + LANE + i));
+        c = _mm_crc32_u64(c, load_word(block + 2 * LANE + i));
+    }
+    uint64_t crc = shift(shift(static_cast<uint32_t>(a)) ^ static_cast<uint32_t>(b)) ^ static_cast<uint32_t>(c);
+    for (uint32_t i = 3 * LANE; i < BlockSize; i += 8) {
+        crc = _mm_crc32_u64(crc, load_word(block + i));
+    }
+    return ~static_cast<uint32_t>(crc);
+}
+#endif
+
+template <uint32_t BlockSize, BlockKernels::Checksum Checksum>
+uint32_t fill_chain(const ChainState& state, uint16_t start, std::istream& is, uint32_t size, uint32_t block_size) {
+    const uint32_t length = BlockSize != 0 ? BlockSize : block_size;
+    uint32_t written = 0;
+    for (uint16_t block = start; size > 0 && block != 0 && block < state.fat_size; block = state.fat[block]) {
+        char* data = state.blocks->pinForOverwrite(block);
+        uint32_t bytes = std::min(size, length);
+        is.read(data, bytes);
+        // Freed blocks are not cleared, so clear the unused tail
+        std::memset(data + bytes, 0, length - bytes);
+        state.checksums[block] = Checksum(data, length);
+        state.blocks->unpin(block);
+        state.generations[block] = state.generation;
+        size -= bytes;
+        written++;
+    }
+    return written;
+}
+
+template <uint32_t BlockSize, BlockKernels::Checksum Checksum>
+uint16_t drain_chain(const ChainState& state, uint16_t start, std::ostream& os, uint32_t size, uint32_t block_size) {
+    const uint32_t length = BlockSize != 0 ? BlockSize : block_size;
+    std::vector<uint16_t> ahead;
+    uint32_t index = 0;
+    for (uint16_t block = start; size > 0 && block != 0 && block < state.fat_size; block = state.fat[block]) {
+        // Read ahead along the chain, not the next physical blocks
+        if (state.readahead > 0 && index++ % state.readahead == 0) {
+            uint32_t count = std::min(state.readahead, (size + length - 1) / length);
+            ahead.clear();
+            for (uint16_t next = block; ahead.size() < count && next != 0 && next < state.fat_size; next = state.fat[next]) {
+                ahead.push_back(next);
+            }
+            state.blocks->readahead(ahead);
+        }
+
+        const char* data = state.blocks->pin(block, false);
+        if (state.checksums[block] != Checksum(data, length)) {
+            state.blocks->unpin(block);
+            return block;
+        }
+        uint32_t bytes = std::min(size, length);
+        os.write(data, bytes);
+        state.blocks->unpin(block);
+        size -= bytes;
+    }
+    return 0;
+}
+
+template <uint32_t BlockSize, BlockKernels::Checksum Checksum>
+void set_checksum(BlockKernels& kernels) {
+    kernels.checksum = Checksum;
+    kernels.fill_chain = fill_chain<BlockSize, Checksum>;
+    kernels.drain_chain = drain_chain<BlockSize, Checksum>;
+}
+
+template <uint32_t BlockSize>
+BlockKernels make_kernels() {
+    BlockKernels kernels;
+    kernels.block_size = BlockSize;
+    kernels.chain_blocks = chain_blocks<BlockSize>;
+    kernels.copy = copy_block<BlockSize>;
+    set_checksum<BlockSize, checksum_block<BlockSize>>(kernels);
+    return kernels;
+}
+
+template <uint32_t BlockSize>
+BlockKernels make_specialized_kernels() {
+    BlockKernels kernels = make_kernels<BlockSize>();
+#ifdef BLOCK_KERNELS_HAVE_SSE42
+    if (crc32c_hardware_accelerated()) {
+        set_checksum<BlockSize, checksum_block_sse42<BlockSize>>(kernels);
+    }
+#endif
+    return kernels;
+}
+
+}
+
+
+const BlockKernels& select_block_kernels(uint32_t block_size, bool specialized) {
+    // Built on first use, after the CRC32C implementation has been chosen
+    static const BlockKernels generic = make_kernels<0>();
+    static const BlockKernels kernels_512 = make_specialized_kernels<512>();
+    static const BlockKernels kernels_1024 = make_specialized_kernels<1024>();
+    static const BlockKernels kernels_2048 = make_specialized_kernels<2048>();
+    static const BlockKernels kernels_4096 = make_specialized_kernels<4096>();
+    if (!specialized) {
+        return generic;
+    }
+    switch (block_size) {
+        case 512:
+            return kernels_512;
+        case 1024:
+            return kernels_1024;
+        case 2048:
+            return kernels_2048;
+        case 4096:
+            return kernels_4096;
+        default:
+            return generic;
+    }
+}
@@ -0,0 +1,49 @@
+#ifndef BLOCKKERNELS_H
+#define BLOCKKERNELS_H
+
+#include <cstdint>
+#include <iosfwd>
+
+class BufferCache;
+
+// The block state of a FileSystem that the chain kernels read and update
+struct ChainState {
+    BufferCache* blocks;
+    const uint16_t* fat;
+    uint32_t fat_size;      // Chain links at or past this end the chain
+    uint32_t* checksums;
+    uint32_t* generations;  // Stamped with 'generation' for each block written
+    uint32_t generation;
+    uint32_t readahead;     // Blocks per readahead batch when disk-resident, else 0
+};
+
+// Per-block work on the data path, instantiated for each common block size
+// (512 to 4096 bytes) so sizes and loop bounds are compile-time constants,
+// and once more generically for any other size. A FileSystem picks its set
+// once, when the image geometry is known. Every kernel takes the block size;
+// the specialized ones ignore it. The chain kernels run a whole file's
+// block loop, so an operation makes one indirect call rather than several
+// per block and the per-block work is inlined into the loop.
+struct BlockKernels {
+    typedef uint32_t (*Checksum)(const char* block, uint32_t block_size);
+
+    uint32_t block_size; // 0 for the generic set
+    uint32_t (*chain_blocks)(uint32_t file_size, uint32_t block_size); // Blocks a file needs; at least one
+    Checksum checksum;   // CRC32C of a whole block
+    void (*copy)(char* destination, const char* source, uint32_t block_size);
+
+    // Write 'size' bytes of the stream into the chain from 'start', clearing
+    // the rest of the last block, and checksum each block. Returns the
+    // number of blocks written.
+    uint32_t (*fill_chain)(const ChainState& state, uint16_t start, std::istream& is, uint32_t size, uint32_t block_size);
+    // Verify each block and write the first 'size' bytes of the chain from
+    // 'start' to the stream. Returns 0, or the block whose checksum failed
+    // (block 0 is never part of a chain).
+    uint16_t (*drain_chain)(const ChainState& state, uint16_t start, std::ostream& os, uint32_t size, uint32_t block_size);
+};
+
+// The kernels for a block size; the generic set if it has no specialization
+// or 'specialized' is false
+const BlockKernels& select_block_kernels(uint32_t block_size, bool specialized = true);
+
+#endif
@@ -0,0 +1,240 @@
+#include "buffercache.h"
+#include <stdexcept>
+#include <exception>
+#include <fcntl.h>
+#include <unistd.h>
+
+BufferCache::BufferCache()
+    : hits(0), misses(0), evictions(0), writebacks(0), readahead_blocks(0),
+      disk_resident(false), block_size(0), block_offset(0), image_fd(-1), spill_fd(-1), num_frames(0), clock_hand(0),
+      backend(BACKEND_PREAD), loading_frames(0) {
+}
+
+BufferCache::~BufferCache() {
+    if (image_fd >= 0) {
+        close(image_fd);
+    }
+    if (spill_fd >= 0) {
+        close(spill_fd);
+    }
+}
+
+void BufferCache::initMemory(uint32_t total_blocks, uint32_t block_size) {
+    this->block_size = block_size;
+    disk_resident = false;
+    num_frames = total_blocks;
+    memory.assign(static_cast<size_t>(total_blocks) * block_size, '\0');
+}
+
+void BufferCache::initDisk(const std::string& image_file, uint64_t block_offset, uint32_t total_blocks, uint32_t block_size, uint32_t capacity, IOBackend backend) {
+    this->block_size = block_size;
+    this->backend = backend;
+    io.init(backend, IO_QUEUE_DEPTH);
+    disk_resident = true;
+    num_frames = capacity;
+    memory.assign(static_cast<size_t>(capacity) * block_size, '\0');
+    frames.assign(capacity, Frame{-1, 0, false, false, false});
+    block_frames.assign(total_blocks, -1);
+    spilled.assign(total_blocks, false);
+    rebind(image_file, block_offset);
+}
+
+void BufferCache::rebind(const std::string& image_file, uint64_t block_offset) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (image_fd >= 0) {
+        close(image_fd);
+    }
+    this->image_file = image_file;
+    this->block_offset = block_offset;
+    image_fd = open(image_file.c_str(), O_RDONLY);
+    if (image_fd < 0) {
+        throw std::runtime_error("Failed to open image " + image_file);
+    }
+
+    // Everything cached or spilled is now in the image as well
+    for (Frame& frame : frames) {
+        frame.dirty = false;
+    }
+    spilled.assign(spilled.size(), false);
+    if (spill_fd >= 0 && ftruncate(spill_fd, 0) != 0) {
+        throw std::runtime_error("Failed to truncate spill file");
+    }
+}
+
+char* BufferCache::pinFrame(uint16_t block, bool modify, bool load) {
+    std::unique_lock<std::mutex> lock(mutex);
+    int32_t frame = block_frames[block];
+    while (frame >= 0 && frames[frame].loading) {
+        loaded.wait(lock);
+        frame = block_frames[block];
+    }
+    if (frame >= 0) {
+        hits++;
+    } else {
+        misses++;
+        frame = claimFrame();
+        if (load) {
+            std::vector<BlockRequest> requests(1, loadRequest(block, frame));
+            io.run(requests);
+        }
+        frames[frame] = Frame{block, 0, false, false, false};
+        block_frames[block] = frame;
+    }
+
+    frames[frame].pins++;
+    frames[frame].referenced = true;
+    frames[frame].dirty = frames[frame].dirty || modify;
+    return frameData(frame);
+}
+
+void BufferCache::unpinFrame(uint16_t block) {
+    std::lock_guard<std::mutex> lock(mutex);
+    int32_t frame = block_frames[block];
+    if (frame >= 0 && frames[frame].pins > 0) {
+        frames[frame].pins--;
+    }
+}
+
+// Claim frames for every missing block under the mutex, then read them all
+// in one batch without it. Claimed frames stay pinned and marked loading
+// until their data has arrived, so they are neither evicted nor handed to
+// a reader early; pinFrame waits for them instead.
+void BufferCache::readahead(const std::vector<uint16_t>& blocks) {
+    if (!disk_resident) {
+        return;
+    }
+
+    std::unique_lock<std::mutex> lock(mutex);
+    std::vector<BlockRequest> requests;
+    std::vector<uint32_t> claimed;
+    for (uint16_t block : blocks) {
+        if (block_frames[block] >= 0 || loading_frames + 1 >= num_frames / 2) {
+            continue;
+        }
+        uint32_t frame = claimFrame();
+        requests.push_back(loadRequest(block, frame));
+        frames[frame] = Frame{block, 1, false, true, true};
+        block_frames[block] = frame;
+        claimed.push_back(frame);
+        loading_frames++;
+    }
+    if (claimed.empty()) {
+        return;
+    }
+    std::unique_ptr<BlockIO> batch_io = takeIO();
+    lock.unlock();
+
+    std::exception_ptr failure;
+    try {
+        batch_io->run(requests);
+    } catch (...) {
+        failure = std::current_exception();
+    }
+
+    lock.lock();
+    idle_io.push_back(std::move(batch_io));
+    io.batches++;
+    io.requests_run += requests.size();
+    loading_frames -= claimed.size();
+    for (uint32_t frame : claimed) {
+        if (failure) {
+            // Drop the frames that never got their data
+            block_frames[frames[frame].block] = -1;
+            frames[frame] = Frame{-1, 0, false, false, false};
+        } else {
+            frames[frame].loading = false;
+            frames[frame].pins--;
+        }
+    }
+    loaded.notify_all();
+    if (failure) {
+        std::rethrow_exception(failure);
+    }
+    readahead_blocks += claimed.size();
+}
+
+// A BlockIO for one readahead batch, reused from earlier batches when one
+// is idle. Called with the mutex held.
+std::unique_ptr<BlockIO> BufferCache::takeIO() {
+    if (idle_io.empty()) {
+        std::unique_ptr<BlockIO> batch_io(new BlockIO());
+        batch_io->init(backend, IO_QUEUE_DEPTH);
+        return batch_io;
+    }
+    std::unique_ptr<BlockIO> batch_io = std::move(idle_io.back());
+    idle_io.pop_back();
+    return batch_io;
+}
+
+// Find a frame for a new block with CLOCK: frames referenced since the hand
+// last passed get a second chance. A dirty victim is written to the spill
+// file first. Called with the mutex held.
+uint32_t BufferCache::claimFrame() {
+    for (uint32_t step = 0; step < 2 * num_frames; ++step) {
+        uint32_t frame = clock_hand;
+        clock_hand = (clock_hand + 1) % num_frames;
+
+        Frame& candidate = frames[frame];
+        if (candidate.block < 0) {
+            return frame;
+        }
+        if (candidate.pins > 0) {
+            continue;
+        }
+        if (candidate.referenced) {
+            candidate.referenced = false;
+            continue;
+        }
+
+        if (candidate.dirty) {
+            writeBack(frame);
+        }
+        block_frames[candidate.block] = -1;
+        candidate = Frame{-1, 0, false, false, false};
+        evictions++;
+        return frame;
+    }
+    throw std::runtime_error("Buffer cache has no unpinned frame");
+}
+
+// Write the victim to the spill file together with the next dirty unpinned
+// frames on the clock, up to one queue depth, so that the evictions that
+// follow find clean frames. Called with the mutex held.
+void BufferCache::writeBack(uint32_t victim) {
+    if (spill_fd < 0) {
+        std::string spill_path = image_file + ".spill";
+        spill_fd = open(spill_path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+        if (spill_fd < 0) {
+            throw std::runtime_error("Failed to create spill file");
+        }
+        unlink(spill_path.c_str());
+    }
+
+    std::vector<uint32_t> cluster(1, victim);
+    for (uint32_t step = 1; step < num_frames && cluster.size() < io.queueDepth(); ++step) {
+        uint32_t frame = (victim + step) % num_frames;
+        if (frames[frame].block >= 0 && frames[frame].dirty && frames[frame].pins == 0) {
+            cluster.push_back(frame);
+        }
+    }
+
+    std::vector<BlockRequest> requests;
+    for (uint32_t frame : cluster) {
+        requests.push_back(BlockRequest{spill_fd, frameData(frame), block_size,
+                                        static_cast<uint64_t>(frames[frame].block) * block_size, true});
+    }
+    io.run(requests);
+    for (uint32_t frame : cluster) {
+        spilled[frames[frame].block] = true;
+        frames[frame].dirty = false;
+    }
+    writebacks += cluster.size();
+}
+
+// Read of a block's latest data into a frame. Called with the mutex held.
+BlockRequest BufferCache::loadRequest(uint16_t block, uint32_t frame) {
+    if (spilled[block]) {
+        return BlockRequest{spill_fd, frameData(frame), block_size, static_cast<uint64_t>(block) * block_size, false};
+    }
+    return BlockRequest{image_fd, frameData(frame), block_size, block_offset + static_cast<uint64_t>(block) * block_size, false};
+}
@@ -0,0 +1,110 @@
+#ifndef BUFFERCACHE_H
+#define BUFFERCACHE_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include "blockio.h"
+
+// Requests kept in flight by readahead and write-back batches
+const unsigned int IO_QUEUE_DEPTH = 32;
+
+// Block storage for a FileSystem. By default every block is resident in
+// memory. In disk-resident mode only 'capacity' blocks are held, in frames
+// recycled with CLOCK eviction, and the rest are read from the image file
+// on demand. Pinned frames are never evicted. Dirty frames are written back
+// on eviction to an unlinked spill file rather than to the image, so the
+// image stays the last checkpoint and the journal stays the only record of
+// newer changes. Readahead and write-back go through BlockIO in batches.
+// A readahead batch runs without the cache mutex, on a BlockIO of its own,
+// so several threads can have their batches in flight at once.
+class BufferCache {
+    public:
+        BufferCache();
+        ~BufferCache();
+
+        void initMemory(uint32_t total_blocks, uint32_t block_size);
+        void initDisk(const std::string& image_file, uint64_t block_offset, uint32_t total_blocks, uint32_t block_size, uint32_t capacity, IOBackend backend);
+        // The image was rewritten with the current contents of every block
+        void rebind(const std::string& image_file, uint64_t block_offset);
+
+        bool diskResident() const { return disk_resident; }
+        uint32_t capacity() const { return num_frames; }
+
+        // Data of a block, valid until the matching unpin. 'modify' marks
+        // the block dirty.
+        char* pin(uint16_t block, bool modify) {
+            if (!disk_resident) {
+                return memory.data() + static_cast<size_t>(block) * block_size;
+            }
+            return pinFrame(block, modify, true);
+        }
+        // Like pin(block, true) for a caller that overwrites the whole
+        // block, so its old contents are never read
+        char* pinForOverwrite(uint16_t block) {
+            if (!disk_resident) {
+                return memory.data() + static_cast<size_t>(block) * block_size;
+            }
+            return pinFrame(block, true, false);
+        }
+        void unpin(uint16_t block) {
+            if (disk_resident) {
+                unpinFrame(block);
+            }
+        }
+
+        // All blocks back to back; only valid when not disk-resident
+        char* residentData() { return memory.data(); }
+
+        // Load the blocks ahead of use without pinning them. Blocks that do
+        // not fit in half the frames (shared by concurrent calls) are skipped.
+        void readahead(const std::vector<uint16_t>& blocks);
+
+        uint64_t hits;
+        uint64_t misses;
+        uint64_t evictions;
+        uint64_t writebacks;
+        uint64_t readahead_blocks;
+        BlockIO io;
+
+    private:
+        struct Frame {
+            int32_t block;   // -1 when empty
+            uint32_t pins;
+            bool dirty;
+            bool referenced; // Second chance for CLOCK
+            bool loading;    // Claimed by a readahead whose data has not arrived
+        };
+
+        bool disk_resident;
+        uint32_t block_size;
+        std::vector<char> memory; // Every block, or the frames when disk-resident
+
+        std::string image_file;
+        uint64_t block_offset; // Where the block area starts in the image
+        int image_fd;
+        int spill_fd;
+        uint32_t num_frames;
+        std::vector<Frame> frames;
+        std::vector<int32_t> block_frames; // Frame holding each block, or -1
+        std::vector<bool> spilled;         // Blocks whose latest data is in the spill file
+        uint32_t clock_hand;
+        IOBackend backend;
+        std::vector<std::unique_ptr<BlockIO>> idle_io; // For readahead batches
+        uint32_t loading_frames;
+        std::mutex mutex;
+        std::condition_variable loaded; // Signalled when readahead frames are filled or dropped
+
+        char* pinFrame(uint16_t block, bool modify, bool load);
+        void unpinFrame(uint16_t block);
+        uint32_t claimFrame();
+        std::unique_ptr<BlockIO> takeIO();
+        void writeBack(uint32_t victim);
+        BlockRequest loadRequest(uint16_t block, uint32_t frame);
+        char* frameData(uint32_t frame) { return memory.data() + static_cast<size_t>(frame) * block_size; }
+};
+
+#endif
@@ -0,0 +1,326 @@
+#include "commands.h"
+#include "metrics.h"
+#include "trace.h"
+#include "utility.h"
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <sys/stat.h>
+
+namespace {
+
+uint64_t host_file_size(const std::string& path) {
+    struct stat file_stat;
+    return stat(path.c_str(), &file_stat) == 0 ? file_stat.st_size : 0;
+}
+
+int run_operation(FileSystem& fs, const std::string& program, const std::vector<std::string>& args);
+
+}
+
+
+// Run one operation, appending it to the trace when tracing is on. A batch
+// is traced as the operations it runs.
+int run_command(FileSystem& fs, const std::string& program, const std::vector<std::string>& args) {
+    if (!tracing() || args[0] == "batch") {
+        return run_operation(fs, program, args);
+    }
+
+    TraceRecord record;
+    record.args = args;
+    record.data_size = 0;
+    if ((args[0] == "write" || args[0] == "overwrite" || args[0] == "append") && args.size() == 3) {
+        record.data_size = host_file_size(args[2]);
+    } else if (args[0] == "addpw" && args.size() == 3) {
+        record.args.pop_back(); // Never store passwords
+    }
+
+    record.start_ns = trace_clock();
+    record.status = run_operation(fs, program, args);
+    record.duration_ns = trace_clock() - record.start_ns;
+
+    if (args[0] == "read" && args.size() == 3) {
+        record.data_size = host_file_size(args[2]);
+    }
+    trace_operation(record);
+    return record.status;
+}
+
+// Commit, tracing the commit as an operation of its own
+void commit_command(FileSystem& fs) {
+    if (!tracing()) {
+        fs.commit();
+        return;
+    }
+
+    TraceRecord record;
+    record.args.push_back("commit");
+    record.data_size = 0;
+    record.status = 0;
+    record.start_ns = trace_clock();
+    fs.commit();
+    record.duration_ns = trace_clock() - record.start_ns;
+    trace_operation(record);
+}
+
+namespace {
+
+int run_operation(FileSystem& fs, const std::string& program, const std::vector<std::string>& args) {
+    if (args[0] == "dir") {
+        if (args.size() != 2) {
+            std::cerr << "Usage: " << program << " <fileSystem.data> dir <path>" << std::endl;
+            return 1;
+        }
+        fs.dir(args[1]);
+    } else if (args[0] == "mkdir") {
+        if (args.size() != 2) {
+            std::cerr << "Usage: " << program << " <fileSystem.data> mkdir <path>" << std::endl;
+            return 1;
+        }
+        fs.mkdir(args[1]);
+    } else if (args[0] == "rmdir") {
+        if (args.size() != 2) {
+            std::cerr << "Usage: " << program << " <fileSystem.data> rmdir <path>" << std::endl;
+            return 1;
+        }
+        fs.rmdir(args[1]);
+    } else if (args[0] == "dumpe2fs") {
+        if (args.size() != 1) {
+            std::cerr << "Usage: " << program << " <fileSystem.data> dumpe2fs" << std::endl;
+            return 1;
+        }
+        fs.dumpe2fs();
+    } else if (args[0] == "du") {
+        if (args.size() != 2) {
+            std::cerr << "Usage: " << program << " <fileSystem.data> du <path>" << std::endl;
+            return 1;
+        }
+        fs.du(args[1]);
+    } else if (args[0] == "write") {
+        if (args.size() != 3) {
+            std::cerr << "Usage: " << program << " <fileSystem.data> write <path> <linux_file>" << std::endl;
+            return 1;
+        }
+        fs.write(args[1], args[2]);
+    } else if (args[0] == "read") {
+        if (args.size() != 3) {
+            std::cerr << "Usage: " << program << " <fileSystem.data> read <path> <linux_file>" << std::endl;
+            return 1;
+        }
+        fs.read(args[1], args[2]);
+    } else if (args[0] == "overwrite") {
+        if (args.size() != 3) {
+            std::cerr << "Usage: " << program << " <fileSystem.data> overwrite <path> <linux_file>" << std::endl;
+            return 1;
+        }
+        fs.overwrite(args[1], args[2]);
+    } else if (args[0] == "append") {
+        if (args.size() != 3) {
+            std::cerr << "Usage: " << program << " <fileSystem.data> append <path> <linux_file>" << std::endl;
+            return 1;
+        }
+        fs.append(args[1], args[2]);
+    } else if (args[0] == "truncate") {
+        uint32_t size;
+        if (args.size() != 3 || !parse_number(args[2], size)) {
+            std::cerr << "Usage: " << program << " <fileSystem.data> truncate <path> <size>" << std::endl;
+            return 1;
+        }
+        fs.fs_truncate(args[1], size);
+    } else if (args[0] == "del") {
+        if (args.size() != 2) {
+            std::cerr << "Usage: " << program << " <fileSystem.data> del <path>" << std::endl;
+            return 1;
+        }
+        fs.del(args[1]);
+    } else if (args[0] == "chmod") {
+        if (args.size() != 3) {
+            std::cerr << "Usage: " << program << " <fileSystem.data> chmod <path> <permissions>" << std::endl;
+            return 1;
+        }
+        fs.fs_chmod(args[1], args[2]);
+    } else if (args[0] == "addpw") {
+        if (args.size() != 3) {
+            std::cerr << "Usage: " << program << " <fileSystem.data> addpw <path> <password>" << std::endl;
+            return 1;
+        }
+        fs.addpw(args[1],args[2]);
+    } else if (args[0] == "cp") {
+        if (args.size() != 3) {
+            std::cerr << "Usage: " << program << " <fileSystem.data> cp <source_path> <destination_path>" << std::endl;
+            return 1;
+        }
+        fs.cp(args[1], args[2]);
+    } else if (args[0] == "mv") {
+        if (args.size() != 3) {
+            std::cerr << "Usage: " << program << " <fileSystem.data> mv <source_path> <destination_path>" << std::endl;
+            return 1;
+        }
+        fs.mv(args[1], args[2]);
+    } else if (args[0] == "snapshot") {
+        if (args.size() != 2) {
+            std::cerr << "Usage: " << program << " <fileSystem.data> snapshot <name>" << std::endl;
+            return 1;
+        }
+        fs.snapshot(args[1]);
+    } else if (args[0] == "snapshots") {
+        if (args.size() != 1) {
+            std::cerr << "Usage: " << program << " <fileSystem.data> snapshots" << std::endl;
+            return 1;
+        }
+        fs.list_snapshots();
+    } else if (args[0] == "delsnapshot") {
+        if (args.size() != 2) {
+            std::cerr << "Usage: " << program << " <fileSystem.data> delsnapshot <name>" << std::endl;
+            return 1;
+        }
+        fs.delete_snapshot(args[1]);
+    } else if (args[0] == "export-delta") {
+        uint32_t from_generation;
+        if (args.size() != 3 || !parse_number(args[1], from_generation)) {
+            std::cerr << "Usage: " << program << " <fileSystem.data> export-delta <from_generation> <delta_file>" << std::endl;
+            return 1;
+        }
+        fs.export_delta(from_generation, args[2]);
+    } else if (args[0] == "apply-delta") {
+        if (args.size() != 2) {
+            std::cerr << "Usage: " << program << " <fileSystem.data> apply-delta <delta_file>" << std::endl;
+            return 1;
+        }
+        return fs.apply_delta(args[1]) ? 0 : 1;
+    } else if (args[0] == "tar-in") {
+        if (args.size() != 2) {
+            std::cerr << "Usage: " << program << " <fileSystem.data> tar-in <path> < archive.tar" << std::endl;
+            return 1;
+        }
+        return fs.tar_in(args[1], std::cin) ? 0 : 1;
+    } else if (args[0] == "tar-out") {
+        if (args.size() != 2) {
+            std::cerr << "Usage: " << program << " <fileSystem.data> tar-out <path> > archive.tar" << std::endl;
+            return 1;
+        }
+        return fs.tar_out(args[1], std::cout) ? 0 : 1;
+    } else if (args[0] == "scrub") {
+        uint32_t threads = 0;
+        if ((args.size() != 1 && args.size() != 2) || (args.size() == 2 && !parse_number(args[1], threads))) {
+            std::cerr << "Usage: " << program << " <fileSystem.data> scrub [threads]" << std::endl;
+            return 1;
+        }
+        fs.scrub(threads);
+    } else if (args[0] == "fsck") {
+        bool repair = args.size() > 1 && args[1] == "-r";
+        size_t threads_arg = repair ? 2 : 1;
+        uint32_t threads = 0;
+        if (args.size() > threads_arg + 1 || (args.size() == threads_arg + 1 && !parse_number(args[threads_arg], threads))) {
+            std::cerr << "Usage: " << program << " <fileSystem.data> fsck [-r] [threads]" << std::endl;
+            return 1;
+        }
+        fs.fsck(repair, threads);
+    } else if (args[0] == "defrag") {
+        uint32_t max_files = 0;
+        if ((args.size() != 1 && args.size() != 2) || (args.size() == 2 && !parse_number(args[1], max_files))) {
+            std::cerr << "Usage: " << program << " <fileSystem.data> defrag [max_files]" << std::endl;
+            return 1;
+        }
+        fs.defrag(max_files);
+    } else if (args[0] == "find") {
+        std::string size_filter;
+        std::string mtime_filter;
+        bool valid = args.size() >= 3 && args.size() % 2 == 1;
+        for (size_t i = 3; valid && i < args.size(); i += 2) {
+            if (args[i] == "--size") {
+                size_filter = args[i + 1];
+            } else if (args[i] == "--mtime") {
+                mtime_filter = args[i + 1];
+            } else {
+                valid = false;
+            }
+        }
+        if (!valid) {
+            std::cerr << "Usage: " << program << " <fileSystem.data> find <path> <glob> [--size [+|-]N[k|M]] [--mtime [+|-]days]" << std::endl;
+            return 1;
+        }
+        fs.find(args[1], args[2], size_filter, mtime_filter);
+    } else if (args[0] == "grep") {
+        if (args.size() != 3) {
+            std::cerr << "Usage: " << program << " <fileSystem.data> grep <pattern> <path>" << std::endl;
+            return 1;
+        }
+        fs.grep(args[1], args[2]);
+    } else if (args[0] == "stats") {
+        if (args.size() != 1) {
+            std::cerr << "Usage: " << program << " <fileSystem.data> stats" << std::endl;
+            return 1;
+        }
+        print_metrics(std::cout);
+        fs.print_cache_stats();
+    } else if (args[0] == "checkpoint") {
+        if (args.size() != 1) {
+            std::cerr << "Usage: " << program << " <fileSystem.data> checkpoint" << std::endl;
+            return 1;
+        }
+        fs.checkpoint(false);
+    } else if (args[0] == "batch") {
+        uint32_t group_size = DEFAULT_GROUP_SIZE;
+        if ((args.size() != 2 && args.size() != 3) || (args.size() == 3 && !parse_number(args[2], group_size))) {
+            std::cerr << "Usage: " << program << " <fileSystem.data> batch <commands_file|-> [group_size]" << std::endl;
+            return 1;
+        }
+        return run_batch(fs, program, args[1], group_size);
+    } else {
+        std::cerr << "Unknown operation: " << args[0] << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
+
+}
+
+// Run one operation per line and commit every group_size operations, so a
+// whole group costs one journal append and one fdatasync. Password prompts
+// read standard input, so protected files need a commands file rather than "-".
+int run_batch(FileSystem& fs, const std::string& program, const std::string& commands_file, uint32_t group_size) {
+    std::ifstream file;
+    if (commands_file != "-") {
+        file.open(commands_file);
+        if (!file.is_open()) {
+            std::cerr << "Error: Unable to open commands file: " << commands_file << std::endl;
+            return 1;
+        }
+    }
+    std::istream& input = (commands_file == "-") ? std::cin : file;
+
+    int status = 0;
+    uint32_t pending = 0;
+    std::string line;
+    while (std::getline(input, line)) {
+        std::istringstream iss(line);
+        std::vector<std::string> args;
+        std::string arg;
+        while (iss >> arg) {
+            args.push_back(arg);
+        }
+        if (args.empty() || args[0][0] == '#') {
+            continue;
+        }
+        if (args[0] == "batch") {
+            std::cerr << "Error: Batches cannot be nested." << std::endl;
+            status = 1;
+            continue;
+        }
+
+        if (run_command(fs, program, args) != 0) {
+            status = 1;
+        }
+        if (group_size > 0 && ++pending == group_size) {
+            commit_command(fs);
+            pending = 0;
+        }
+    }
+
+    commit_command(fs);
+    return status;
+}
@@ -0,0 +1,16 @@
+#ifndef COMMANDS_H
+#define COMMANDS_H
+
+#include <string>
+#include <vector>
+#include "filesystem.h"
+
+const uint32_t DEFAULT_GROUP_SIZE = 64; // Operations per journal commit in batch mode
+
+// Run one operation; args[0] is the operation name, followed by its parameters.
+// Returns 0 on success and 1 on a usage error, a failed tar transfer or a rejected delta.
+int run_command(FileSystem& fs, const std::string& program, const std::vector<std::string>& args);
+void commit_command(FileSystem& fs);
+int run_batch(FileSystem& fs, const std::string& program, const std::string& commands_file, uint32_t group_size);
+
+#endif
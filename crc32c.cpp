@@ -0,0 +1,89 @@
+#include "crc32c.h"
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#define CRC32C_HAVE_SSE42 1
+#endif
+
+namespace {
+
+const uint32_t CRC32C_POLYNOMIAL = 0x82F63B78; // Reflected Castagnoli polynomial
+
+struct Crc32cTable {
+    uint32_t entries[256];
+
+    Crc32cTable() {
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t crc = i;
+            for (int bit = 0; bit < 8; ++bit) {
+                crc = (crc >> 1) ^ ((crc & 1) ? CRC32C_POLYNOMIAL : 0);
+            }
+            entries[i] = crc;
+        }
+    }
+};
+
+uint32_t crc32c_portable(const void* data, size_t length) {
+    static const Crc32cTable table;
+    const unsigned char* bytes = static_cast<const unsigned char*>(data);
+    uint32_t crc = 0xFFFFFFFF;
+    for (size_t i = 0; i < length; ++i) {
+        crc = table.entries[(crc ^ bytes[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+#ifdef CRC32C_HAVE_SSE42
+__attribute__((target("sse4.2")))
+uint32_t crc32c_sse42(const void* data, size_t length) {
+    const unsigned char* bytes = static_cast<const unsigned char*>(data);
+    uint32_t crc = 0xFFFFFFFF;
+
+#if defined(__x86_64__)
+    uint64_t crc64 = crc;
+    while (length >= sizeof(uint64_t)) {
+        uint64_t word;
+        std::memcpy(&word, bytes, sizeof(word));
+        crc64 = _mm_crc32_u64(crc64, word);
+        bytes += sizeof(word);
+        length -= sizeof(word);
+    }
+    crc = static_cast<uint32_t>(crc64);
+#endif
+
+    while (length > 0) {
+        crc = _mm_crc32_u8(crc, *bytes++);
+        length--;
+    }
+    return ~crc;
+}
+#endif
+
+typedef uint32_t (*Crc32cFunction)(const void*, size_t);
+
+Crc32cFunction select_crc32c() {
+#ifdef CRC32C_HAVE_SSE42
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2")) {
+        return crc32c_sse42;
+    }
+#endif
+    return crc32c_portable;
+}
+
+const Crc32cFunction crc32c_implementation = select_crc32c();
+
+}
+
+uint32_t crc32c(const void* data, size_t length) {
+    return crc32c_implementation(data, length);
+}
+
+bool crc32c_hardware_accelerated() {
+#ifdef CRC32C_HAVE_SSE42
+    return crc32c_implementation == crc32c_sse42;
+#else
+    return false;
+#endif
+}
@@ -0,0 +1,12 @@
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include <cstddef>
+#include <cstdint>
+
+// CRC32C (Castagnoli). Uses the SSE4.2 crc32 instruction when the CPU has
+// it and a lookup table otherwise; the choice is made once at startup.
+uint32_t crc32c(const void* data, size_t length);
+bool crc32c_hardware_accelerated();
+
+#endif
@@ -0,0 +1,157 @@
+#include "filesystem.h"
+#include <iostream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cstring>
+#include "metrics.h"
+
+/*
+DEFRAG
+Moves each fragmented file's private blocks (those before the first block
+shared by cp or a snapshot) into a free contiguous run. Files of a
+directory are placed one after another, so siblings end up side by side.
+Shared blocks stay where they are, since other chains link to them. The
+fragmentation score is the share of FAT links that do not point at the
+following block.
+*/
+
+void FileSystem::defrag(uint32_t max_files) {
+    if (!checkWritable()) {
+        return;
+    }
+
+    printFragmentation("Before");
+    uint32_t moved_files = 0;
+    uint32_t moved_blocks = 0;
+    uint32_t unplaced_files = 0;
+    defragDirectory(root_directory, max_files, moved_files, moved_blocks, unplaced_files);
+
+    std::cout << "Relocated Files: " << moved_files << " (" << moved_blocks << " blocks)" << std::endl;
+    if (unplaced_files > 0) {
+        std::cout << "Files Without a Free Run: " << unplaced_files << std::endl;
+    }
+    printFragmentation("After");
+    if (max_files > 0 && moved_files == max_files) {
+        std::cout << "Stopped after " << max_files << " files; run defrag again to continue." << std::endl;
+    }
+}
+
+// Defragment the directory's files, then its subdirectories. Stops once
+// max_files files have been moved, if max_files is set.
+void FileSystem::defragDirectory(DirectoryEntry& directory, uint32_t max_files, uint32_t& moved_files, uint32_t& moved_blocks, uint32_t& unplaced_files) {
+    uint16_t goal = 1;
+    for (auto& entry : directory.children) {
+        if (is_directory(entry)) {
+            continue;
+        }
+        if (max_files > 0 && moved_files >= max_files) {
+            return;
+        }
+
+        // The private prefix of the chain, bounded in case of a cycle
+        std::vector<uint16_t> chain;
+        uint16_t block = entry.getStartBlock();
+        while (isChainBlock(block) && refcounts[block] == 1 && chain.size() < fat.size()) {
+            chain.push_back(block);
+            block = fat[block];
+        }
+        if (chain.empty()) {
+            continue;
+        }
+
+        bool fragmented = false;
+        for (size_t i = 1; i < chain.size() && !fragmented; ++i) {
+            fragmented = chain[i] != chain[i - 1] + 1;
+        }
+        if (!fragmented) {
+            goal = chain.back() + 1;
+            continue;
+        }
+
+        uint16_t run = findFreeRun(chain.size(), goal);
+        if (run == FAT_FREE) {
+            unplaced_files++;
+            continue;
+        }
+
+        // Copy the prefix into the run; the last copy links to the shared rest
+        uint16_t successor = fat[chain.back()];
+        for (size_t i = 0; i < chain.size(); ++i) {
+            if (i % READAHEAD_BLOCKS == 0) {
+                blocks.readahead(std::vector<uint16_t>(chain.begin() + i, chain.begin() + std::min(chain.size(), i + READAHEAD_BLOCKS)));
+            }
+            uint16_t target = run + i;
+            claimBlock(target);
+            kernels->copy(blocks.pinForOverwrite(target), blocks.pin(chain[i], false), superblock.block_size);
+            blocks.unpin(chain[i]);
+            blocks.unpin(target);
+            block_checksums[target] = block_checksums[chain[i]];
+            refcounts[target] = 1;
+            fat[target] = i + 1 < chain.size() ? target + 1 : successor;
+        }
+        entry.setStartBlock(run);
+        touchEntry(entry);
+
+        // Free the old blocks
+        for (uint16_t old_block : chain) {
+            fat[old_block] = FAT_FREE;
+            refcounts[old_block] = 0;
+            markBlock(old_block);
+        }
+        superblock.free_blocks += chain.size();
+        count_metric(COUNTER_BLOCKS_FREED, chain.size());
+
+        moved_files++;
+        moved_blocks += chain.size();
+        goal = run + chain.size();
+    }
+
+    for (auto& entry : directory.children) {
+        if (is_directory(entry)) {
+            defragDirectory(entry, max_files, moved_files, moved_blocks, unplaced_files);
+        }
+    }
+}
+
+// Print the share of discontiguous FAT links and of live files with at
+// least one
+void FileSystem::printFragmentation(const std::string& label) {
+    uint32_t links = 0;
+    uint32_t broken_links = 0;
+    for (uint32_t block = 1; block < fat.size(); ++block) {
+        if (isChainBlock(fat[block])) {
+            links++;
+            if (fat[block] != block + 1) {
+                broken_links++;
+            }
+        }
+    }
+
+    uint32_t files = 0;
+    uint32_t fragmented_files = 0;
+    std::vector<const DirectoryEntry*> pending(1, &root_directory);
+    while (!pending.empty()) {
+        const DirectoryEntry* directory = pending.back();
+        pending.pop_back();
+        for (const auto& entry : directory->children) {
+            if (entry.getAttribute() & ATTR_DIRECTORY) {
+                pending.push_back(&entry);
+                continue;
+            }
+            files++;
+            uint16_t block = entry.getStartBlock();
+            for (size_t hops = 0; isChainBlock(block) && isChainBlock(fat[block]) && hops < fat.size(); ++hops) {
+                if (fat[block] != block + 1) {
+                    fragmented_files++;
+                    break;
+                }
+                block = fat[block];
+            }
+        }
+    }
+
+    std::cout << "Fragmentation " << label << ": " << (links > 0 ? 100.0 * broken_links / links : 0)
+              << "% (" << broken_links << " of " << links << " links discontiguous, "
+              << fragmented_files << " of " << files << " files fragmented)" << std::endl;
+}
@@ -0,0 +1,529 @@
+#include "filesystem.h"
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <stdexcept>
+#include <algorithm>
+#include <cstring>
+#include "utility.h"
+
+/*
+DELTA STREAMS
+A delta holds everything stamped after a given generation: the changed FAT
+ranges (with reference counts), the data of changed
+blocks that are in use, the directory changes, and
+the snapshot list if it changed, and the volume counters. Directory changes
+go out as removed names and changed entries, so one change in a large
+directory costs the same as in a small one; a whole listing is only sent
+for a directory that may be new to the receiver or that lost children
+outside its in-memory removal log. Changed entries carry their cached
+tail, preceded by a DELTA_SHARED record if chains became shared in the
+range, which drops the tails the receiver cached before. Applying a delta
+overwrites state rather than adjusting it, so replaying one twice is
+harmless. The journal stores its records in the same format. Version 1
+streams have no counters record, so they are recounted after applying.
+*/
+
+// A delta read in full and checked, before any of it is applied
+struct FatRange {
+    uint32_t first;
+    std::vector<uint16_t> fat;
+    std::vector<uint32_t> refcounts;
+};
+
+struct BlockData {
+    uint16_t block;
+    std::string bytes;
+};
+
+struct TreeChange {
+    uint8_t type; // DELTA_DIRECTORY, DELTA_ENTRY, DELTA_REMOVAL or DELTA_SHARED
+    std::string path;
+    DirectoryEntry entry;
+    std::vector<DirectoryEntry> listed; // DELTA_DIRECTORY
+    uint16_t tail;                      // DELTA_ENTRY
+};
+
+struct DeltaRecords {
+    std::vector<FatRange> fat_ranges;
+    std::vector<BlockData> block_data;
+    std::vector<TreeChange> tree_changes; // In stream order
+    bool has_snapshots = false;
+    std::vector<Snapshot> snapshots;
+    bool has_counters = false;
+    uint32_t free_blocks = 0;
+    uint32_t num_files = 0;
+    uint32_t num_directories = 0;
+};
+
+namespace {
+
+template <typename T>
+void write_value(std::ostream& os, const T& value) {
+    os.write(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+template <typename T>
+T read_value(std::istream& is) {
+    T value;
+    if (!is.read(reinterpret_cast<char*>(&value), sizeof(value))) {
+        throw std::runtime_error("Truncated delta stream");
+    }
+    return value;
+}
+
+void write_string(std::ostream& os, const std::string& value) {
+    write_value<uint32_t>(os, value.size());
+    os.write(value.data(), value.size());
+}
+
+std::string read_string(std::istream& is) {
+    uint32_t length = read_value<uint32_t>(is);
+    std::string value(length, '\0');
+    if (!is.read(&value[0], length)) {
+        throw std::runtime_error("Truncated delta stream");
+    }
+    return value;
+}
+
+std::string child_path(const std::string& parent, const std::string& name) {
+    return parent == "/" ? "/" + name : parent + "/" + name;
+}
+
+// Carry a directory's subtree and link state over to its updated entry
+void adopt_directory(DirectoryEntry& updated, DirectoryEntry& existing) {
+    updated.children = std::move(existing.children);
+    updated.setLinkGeneration(existing.getLinkGeneration());
+    updated.setUnlinkGeneration(existing.getUnlinkGeneration());
+    updated.setRemovals(existing.getRemovals());
+}
+
+}
+
+
+void FileSystem::export_delta(uint32_t from_generation, const std::string& delta_file) {
+    if (!checkWritable()) {
+        return;
+    }
+
+    if (from_generation >= superblock.generation) {
+        std::cerr << "Error: Generation " << from_generation << " is not older than the current generation " << superblock.generation << "." << std::endl;
+        return;
+    }
+
+    std::ofstream ofs(delta_file, std::ios::binary);
+    if (!ofs.is_open()) {
+        std::cerr << "Error: Unable to open delta file for writing." << std::endl;
+        return;
+    }
+
+    uint32_t changed_blocks = 0;
+    uint32_t to_generation = writeDelta(ofs, from_generation, changed_blocks);
+    ofs.close();
+
+    std::cout << "Exported generations " << from_generation + 1 << " to " << to_generation
+              << " (" << changed_blocks << " changed blocks) to " << delta_file << std::endl;
+}
+
+// Write everything stamped after from_generation and close the open
+// generation, so changes made from now on belong to the next delta.
+// Returns the last generation the delta contains.
+uint32_t FileSystem::writeDelta(std::ostream& os, uint32_t from_generation, uint32_t& changed_blocks) {
+    uint32_t to_generation = advanceGeneration();
+
+    write_value<uint32_t>(os, DELTA_MAGIC);
+    write_value<uint32_t>(os, DELTA_VERSION);
+    write_value<uint32_t>(os, superblock.total_blocks);
+    write_value<uint32_t>(os, superblock.block_size);
+    write_value<uint32_t>(os, from_generation);
+    write_value<uint32_t>(os, to_generation);
+
+    // Changed FAT ranges, each followed by the data of its blocks in use
+    changed_blocks = 0;
+    uint32_t block = 0;
+    while (block < superblock.total_blocks) {
+        if (block_generations[block] <= from_generation) {
+            block++;
+            continue;
+        }
+
+        uint32_t first = block;
+        while (block < superblock.total_blocks && block_generations[block] > from_generation) {
+            block++;
+        }
+        uint32_t count = block - first;
+
+        write_value<uint8_t>(os, DELTA_FAT_RANGE);
+        write_value<uint32_t>(os, first);
+        write_value<uint32_t>(os, count);
+        os.write(reinterpret_cast<const char*>(&fat[first]), count * sizeof(uint16_t));
+        os.write(reinterpret_cast<const char*>(&refcounts[first]), count * sizeof(uint32_t));
+
+        for (uint32_t i = first; i < block; ++i) {
+            if (fat[i] != FAT_FREE) {
+                write_value<uint8_t>(os, DELTA_BLOCK_DATA);
+                write_value<uint16_t>(os, i);
+                os.write(blocks.pin(i, false), superblock.block_size);
+                blocks.unpin(i);
+            }
+        }
+        changed_blocks += count;
+    }
+
+    // Chains shared in the range invalidate every tail cached before it, so
+    // this goes ahead of the entries carrying tails cached since
+    if (shared_generation > from_generation) {
+        write_value<uint8_t>(os, DELTA_SHARED);
+    }
+
+    // Directory mutations, parents before children
+    exportDirectory(os, root_directory, "/", from_generation, false);
+
+    if (superblock.snapshot_generation > from_generation) {
+        write_value<uint8_t>(os, DELTA_SNAPSHOTS);
+        write_string(os, serializeSnapshots());
+    }
+
+    write_value<uint8_t>(os, DELTA_COUNTERS);
+    write_value<uint32_t>(os, superblock.free_blocks);
+    write_value<uint32_t>(os, superblock.num_files);
+    write_value<uint32_t>(os, superblock.num_directories);
+
+    write_value<uint8_t>(os, DELTA_END);
+    return to_generation;
+}
+
+// Emit the directory's changes, then its subdirectories'. A directory linked
+// in after from_generation may be new to the receiver, so its whole subtree
+// is sent as listings. A directory that lost children is sent as a listing
+// too unless its removal log covers every removal since from_generation.
+// Otherwise only the removed names and the changed entries go out; a new
+// subdirectory is sent as an entry first so its listing has a place to go.
+void FileSystem::exportDirectory(std::ostream& os, const DirectoryEntry& directory, const std::string& path, uint32_t from_generation, bool whole_subtree) {
+    const RemovalLog& removals = directory.getRemovals();
+    bool removed = directory.getUnlinkGeneration() > from_generation;
+    if (whole_subtree || (removed && from_generation < std::max(removal_log_start, removals.since))) {
+        write_value<uint8_t>(os, DELTA_DIRECTORY);
+        write_string(os, path);
+        write_entry(os, directory);
+        write_value<uint32_t>(os, directory.children.size());
+        for (const auto& child : directory.children) {
+            write_entry(os, child);
+        }
+    } else {
+        if (removed) {
+            for (const auto& removal : removals.names) {
+                if (removal.first > from_generation) {
+                    write_value<uint8_t>(os, DELTA_REMOVAL);
+                    write_string(os, child_path(path, removal.second));
+                }
+            }
+        }
+        if (directory.getGeneration() > from_generation) {
+            write_value<uint8_t>(os, DELTA_ENTRY);
+            write_string(os, path);
+            write_entry(os, directory);
+            write_value<uint16_t>(os, 0);
+        }
+        for (const auto& child : directory.children) {
+            if (is_directory(child) ? child.getLinkGeneration() > from_generation : child.getGeneration() > from_generation) {
+                write_value<uint8_t>(os, DELTA_ENTRY);
+                write_string(os, child_path(path, child.getFilename()));
+                write_entry(os, child);
+                write_value<uint16_t>(os, child.getTailEpoch() == share_epoch ? child.getTailBlock() : 0);
+            }
+        }
+    }
+
+    for (const auto& child : directory.children) {
+        if (is_directory(child)) {
+            exportDirectory(os, child, child_path(path, child.getFilename()), from_generation,
+                            whole_subtree || child.getLinkGeneration() > from_generation);
+        }
+    }
+}
+
+
+bool FileSystem::apply_delta(const std::string& delta_file) {
+    if (!checkWritable()) {
+        return false;
+    }
+
+    std::ifstream ifs(delta_file, std::ios::binary);
+    if (!ifs.is_open()) {
+        std::cerr << "Error: Unable to open delta file." << std::endl;
+        return false;
+    }
+
+    uint32_t from_generation;
+    uint32_t to_generation;
+    if (!readDeltaHeader(ifs, from_generation, to_generation)) {
+        return false;
+    }
+
+    // Only the directory changes can still fail once the delta has been
+    // read in full, and they are applied first, so restoring the tree
+    // leaves the image as it was
+    DirectoryEntry saved_root = root_directory;
+    uint32_t changed_blocks;
+    try {
+        changed_blocks = applyDelta(ifs);
+    } catch (const std::exception& e) {
+        root_directory = std::move(saved_root);
+        std::cerr << "Error: " << e.what() << " in " << delta_file << std::endl;
+        return false;
+    }
+    markShared(); // Tails cached on the source say nothing about this image
+    superblock.generation = std::max(superblock.generation, to_generation + 1);
+    std::cout << "Applied generations " << from_generation + 1 << " to " << to_generation
+              << " (" << changed_blocks << " changed blocks) from " << delta_file << std::endl;
+    return true;
+}
+
+// Validate a delta header against this image before anything is applied
+bool FileSystem::readDeltaHeader(std::istream& is, uint32_t& from_generation, uint32_t& to_generation) {
+    uint32_t header[6];
+    if (!is.read(reinterpret_cast<char*>(header), sizeof(header)) || header[0] != DELTA_MAGIC || header[1] == 0 || header[1] > DELTA_VERSION) {
+        std::cerr << "Error: Not a delta stream." << std::endl;
+        return false;
+    }
+    if (header[2] != superblock.total_blocks || header[3] != superblock.block_size) {
+        std::cerr << "Error: Delta was exported from a file system with a different geometry." << std::endl;
+        return false;
+    }
+    from_generation = header[4];
+    to_generation = header[5];
+    if (from_generation >= superblock.generation) {
+        std::cerr << "Error: Delta starts after generation " << from_generation
+                  << " but this image only has changes up to generation " << superblock.generation - 1 << "." << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Read every record following a validated header into 'delta', checking
+// bounds and FAT links, without changing anything. A damaged or truncated
+// stream throws.
+void FileSystem::readDelta(std::istream& is, DeltaRecords& delta) {
+    for (;;) {
+        uint8_t type = read_value<uint8_t>(is);
+        if (type == DELTA_END) {
+            return;
+        }
+
+        if (type == DELTA_FAT_RANGE) {
+            FatRange range;
+            range.first = read_value<uint32_t>(is);
+            uint32_t count = read_value<uint32_t>(is);
+            if (range.first > superblock.total_blocks || count > superblock.total_blocks - range.first) {
+                throw std::runtime_error("Delta FAT range out of bounds");
+            }
+            range.fat.resize(count);
+            range.refcounts.resize(count);
+            is.read(reinterpret_cast<char*>(range.fat.data()), count * sizeof(uint16_t));
+            is.read(reinterpret_cast<char*>(range.refcounts.data()), count * sizeof(uint32_t));
+            for (uint16_t next : range.fat) {
+                if (next != FAT_FREE && next != FAT_USED && next != FAT_EOC && (next == 0 || next >= superblock.total_blocks)) {
+                    throw std::runtime_error("Delta FAT link out of bounds");
+                }
+            }
+            delta.fat_ranges.push_back(std::move(range));
+        } else if (type == DELTA_BLOCK_DATA) {
+            BlockData data;
+            data.block = read_value<uint16_t>(is);
+            if (data.block >= superblock.total_blocks) {
+                throw std::runtime_error("Delta block out of bounds");
+            }
+            data.bytes.resize(superblock.block_size);
+            is.read(&data.bytes[0], superblock.block_size);
+            delta.block_data.push_back(std::move(data));
+        } else if (type == DELTA_DIRECTORY || type == DELTA_ENTRY || type == DELTA_REMOVAL || type == DELTA_SHARED) {
+            TreeChange change;
+            change.type = type;
+            change.tail = 0;
+            if (type != DELTA_SHARED) {
+                change.path = read_string(is);
+            }
+            if (type == DELTA_DIRECTORY || type == DELTA_ENTRY) {
+                read_entry(is, change.entry);
+            }
+            if (type == DELTA_DIRECTORY) {
+                uint32_t num_children = read_value<uint32_t>(is);
+                for (uint32_t i = 0; i < num_children && is; ++i) {
+                    change.listed.push_back(DirectoryEntry());
+                    read_entry(is, change.listed.back());
+                }
+            } else if (type == DELTA_ENTRY) {
+                change.tail = read_value<uint16_t>(is);
+            }
+            delta.tree_changes.push_back(std::move(change));
+        } else if (type == DELTA_SNAPSHOTS) {
+            delta.snapshots.clear();
+            deserializeSnapshots(read_string(is), delta.snapshots);
+            delta.has_snapshots = true;
+        } else if (type == DELTA_COUNTERS) {
+            delta.free_blocks = read_value<uint32_t>(is);
+            delta.num_files = read_value<uint32_t>(is);
+            delta.num_directories = read_value<uint32_t>(is);
+            if (delta.free_blocks > superblock.total_blocks) {
+                throw std::runtime_error("Delta counters out of bounds");
+            }
+            delta.has_counters = true;
+        } else {
+            throw std::runtime_error("Unknown delta record");
+        }
+
+        if (!is) {
+            throw std::runtime_error("Truncated delta stream");
+        }
+    }
+}
+
+// Apply the records following a validated header. The whole delta is read
+// and checked first, then the directory changes are applied, the only step
+// that can still fail, and only then the FAT, blocks, snapshots and
+// counters. A failure throws with nothing but the tree changed, so the
+// caller restores the tree or never saves the image. Everything applied is
+// stamped with this image's open generation, so it is journaled and
+// exported again like a local change. Returns the changed block count.
+uint32_t FileSystem::applyDelta(std::istream& is) {
+    DeltaRecords delta;
+    readDelta(is, delta);
+
+    for (TreeChange& change : delta.tree_changes) {
+        if (change.type == DELTA_DIRECTORY) {
+            applyDirectory(change);
+        } else if (change.type == DELTA_ENTRY) {
+            applyEntry(change);
+        } else if (change.type == DELTA_REMOVAL) {
+            applyRemoval(change);
+        } else {
+            share_epoch++;
+        }
+    }
+
+    uint32_t changed_blocks = 0;
+    for (const FatRange& range : delta.fat_ranges) {
+        std::copy(range.fat.begin(), range.fat.end(), fat.begin() + range.first);
+        std::copy(range.refcounts.begin(), range.refcounts.end(), refcounts.begin() + range.first);
+        for (uint32_t i = range.first; i < range.first + range.fat.size(); ++i) {
+            markBlock(i);
+        }
+        changed_blocks += range.fat.size();
+    }
+    for (const BlockData& data : delta.block_data) {
+        std::memcpy(blocks.pinForOverwrite(data.block), data.bytes.data(), superblock.block_size);
+        blocks.unpin(data.block);
+        updateChecksum(data.block);
+    }
+    if (delta.has_snapshots) {
+        snapshots = std::move(delta.snapshots);
+        superblock.snapshot_generation = superblock.generation;
+    }
+
+    if (delta.has_counters) {
+        superblock.free_blocks = delta.free_blocks;
+        superblock.num_files = delta.num_files;
+        superblock.num_directories = delta.num_directories;
+    } else {
+        rebuildVolumeCounters();
+    }
+    modified = true;
+    return changed_blocks;
+}
+
+// Replace a directory's fields and listing with the ones in the record.
+// Subdirectories that still exist keep their children; anything missing
+// from the record is dropped.
+void FileSystem::applyDirectory(TreeChange& change) {
+    DirectoryEntry* directory = findDirectory(change.path);
+    if (directory == nullptr) {
+        throw std::runtime_error("Delta refers to a missing directory: " + change.path);
+    }
+
+    std::map<std::string, DirectoryEntry*> existing;
+    for (auto& child : directory->children) {
+        existing[child.getFilename()] = &child;
+    }
+
+    for (auto& child : change.listed) {
+        auto it = existing.find(child.getFilename());
+        if (it != existing.end() && is_directory(child) && is_directory(*it->second)) {
+            adopt_directory(child, *it->second);
+            touchEntry(child);
+        } else {
+            linkEntry(child);
+        }
+        if (it != existing.end()) {
+            existing.erase(it);
+        }
+    }
+    for (const auto& dropped : existing) {
+        unlinkEntry(*directory, dropped.first);
+    }
+
+    DirectoryEntry& updated = change.entry;
+    adopt_directory(updated, *directory);
+    updated.children = std::move(change.listed);
+    touchEntry(updated);
+    *directory = std::move(updated);
+}
+
+// Insert or update one entry. A directory that is already there keeps its
+// children.
+void FileSystem::applyEntry(TreeChange& change) {
+    DirectoryEntry& updated = change.entry;
+    updated.setTail(change.tail, share_epoch);
+
+    DirectoryEntry* parent = nullptr;
+    DirectoryEntry* existing = &root_directory;
+    if (change.path != "/") {
+        parent = findDirectory(extract_directory_path(change.path));
+        if (parent == nullptr) {
+            throw std::runtime_error("Delta refers to a missing directory: " + extract_directory_path(change.path));
+        }
+        existing = nullptr;
+        for (auto& child : parent->children) {
+            if (child.getFilename() == updated.getFilename()) {
+                existing = &child;
+                break;
+            }
+        }
+    }
+
+    if (existing == nullptr) {
+        linkEntry(updated);
+        parent->children.push_back(std::move(updated));
+        touchEntry(*parent);
+        return;
+    }
+    if (is_directory(updated) != is_directory(*existing)) {
+        linkEntry(updated);
+    } else {
+        if (is_directory(updated)) {
+            adopt_directory(updated, *existing);
+        }
+        updated.setLinkGeneration(existing->getLinkGeneration());
+        touchEntry(updated);
+    }
+    *existing = std::move(updated);
+}
+
+// Remove one entry, with everything below it, if it is still there
+void FileSystem::applyRemoval(TreeChange& change) {
+    DirectoryEntry* parent = findDirectory(extract_directory_path(change.path));
+    if (parent == nullptr) {
+        throw std::runtime_error("Delta refers to a missing directory: " + extract_directory_path(change.path));
+    }
+
+    std::string name = extract_filename(change.path);
+    for (auto it = parent->children.begin(); it != parent->children.end(); ++it) {
+        if (it->getFilename() == name) {
+            parent->children.erase(it);
+            unlinkEntry(*parent, name);
+            return;
+        }
+    }
+}
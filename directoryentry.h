@@ -4,6 +4,7 @@
 #include <ctime>
 #include <string>
 #include <vector>
+#include <utility>
 #include <cstring>
 
 const int MAX_FILE_SYSTEM_SIZE_512 = 2 * 1024 * 1024; // 2 MB for 0.5 KB blocks (Figure 4.1)
@@ -20,6 +21,14 @@ struct Permissions {
     bool write;
 };
 
+// Names unlinked from a directory after generation 'since', oldest first.
+// Only kept in memory; deltas use it to send removals instead of the whole
+// listing.
+struct RemovalLog {
+    uint32_t since;
+    std::vector<std::pair<uint32_t, std::string>> names; // (generation, name)
+};
+
 
 class DirectoryEntry {
 
@@ -32,6 +41,12 @@ class DirectoryEntry {
         std::string password; // Password for file protection, if any
         uint16_t start_block; // Start block in FAT
         uint8_t attribute;
+        uint32_t generation; // Generation of the last change to this entry or its children list
+        uint32_t link_generation; // Generation in which the entry was linked under its parent
+        uint32_t unlink_generation; // Generation of the last removal from this directory's children
+        RemovalLog removals;
+        uint16_t tail_block; // Cached last block of the chain, or 0; stored in the image and in deltas
+        uint32_t tail_epoch; // FileSystem share epoch in which tail_block was cached
 
     public:
 
@@ -44,6 +59,12 @@ class DirectoryEntry {
             modification_time = std::time(nullptr);
             start_block = 0;
             attribute = 0;
+            generation = 0;
+            link_generation = 0;
+            unlink_generation = 0;
+            removals.since = 0;
+            tail_block = 0;
+            tail_epoch = 0;
         }
 
         std::string getFilename() const { return filename; }
@@ -65,11 +86,40 @@ class DirectoryEntry {
         void setPassword(const std::string& new_password) { password = new_password; }
 
         uint16_t getStartBlock() const { return start_block; }
-        void setStartBlock(uint16_t new_start_block) { start_block = new_start_block; }
+        void setStartBlock(uint16_t new_start_block) { start_block = new_start_block; tail_block = 0; }
 
         uint16_t getAttribute() const { return attribute; }
         void  setAttribute(uint16_t attribute) { this->attribute  = attribute; }
 
+        uint32_t getGeneration() const { return generation; }
+        void setGeneration(uint32_t new_generation) { generation = new_generation; }
+
+        uint32_t getLinkGeneration() const { return link_generation; }
+        void setLinkGeneration(uint32_t new_link_generation) { link_generation = new_link_generation; }
+
+        uint32_t getUnlinkGeneration() const { return unlink_generation; }
+        void setUnlinkGeneration(uint32_t new_unlink_generation) { unlink_generation = new_unlink_generation; }
+
+        const RemovalLog& getRemovals() const { return removals; }
+        void setRemovals(const RemovalLog& new_removals) { removals = new_removals; }
+        // Log a removal in 'generation', forgetting the ones up to 'settled'
+        void logRemoval(const std::string& name, uint32_t generation, uint32_t settled) {
+            unlink_generation = generation;
+            if (removals.since < settled) {
+                size_t dropped = 0;
+                while (dropped < removals.names.size() && removals.names[dropped].first <= settled) {
+                    dropped++;
+                }
+                removals.names.erase(removals.names.begin(), removals.names.begin() + dropped);
+                removals.since = settled;
+            }
+            removals.names.push_back(std::make_pair(generation, name));
+        }
+
+        uint16_t getTailBlock() const { return tail_block; }
+        uint32_t getTailEpoch() const { return tail_epoch; }
+        void setTail(uint16_t block, uint32_t epoch) { tail_block = block; tail_epoch = epoch; }
+
 };
 
 
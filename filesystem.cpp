@@ -5,27 +5,41 @@
 #include <string>
 #include <vector>
 #include <sstream>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
 #include <sys/stat.h>
 #include "utility.h"
+#include "crc32c.h"
+#include "metrics.h"
 #include <fcntl.h>
 #include <utime.h>
 
 FileSystem::FileSystem(const std::string& file_name, uint32_t total_blocks, uint32_t block_size) {
+    mounted_root = &root_directory;
+    read_only = false;
+    share_epoch = 1;
+    shared_generation = 0;
+    cache_capacity = 0;
+    io_backend = BACKEND_PREAD;
     superblock.total_blocks = total_blocks;
     superblock.block_size = block_size;
+    kernels = &select_block_kernels(block_size);
     superblock.fat_start = sizeof(Superblock);
     superblock.root_dir_start = superblock.fat_start + (total_blocks * sizeof(uint16_t));
+    superblock.generation = 1;
+    superblock.snapshot_generation = 0;
+    superblock.free_blocks = total_blocks;
+    superblock.num_files = 0;
+    superblock.num_directories = 1;
     fat.resize(total_blocks, 0);
     std::fill(fat.begin(), fat.end(), FAT_FREE);
+    refcounts.assign(total_blocks, 0);
+    block_generations.assign(total_blocks, 0);
+    block_checksums.assign(total_blocks, crc32c(std::vector<char>(block_size, '\0').data(), block_size));
 
-    // Resize the vector of blocks to hold 'total_blocks' DiskBlock objects
-    blocks.resize(total_blocks);
-
-    // Initialize each DiskBlock with its block number and empty data space
-    for (uint32_t i = 0; i < total_blocks; ++i) {
-        // Initialize data vector with empty space (1KB in this case)
-        blocks[i].data.resize(superblock.block_size, '\0');
-    }
+    // Every block starts out resident and zero filled
+    blocks.initMemory(total_blocks, block_size);
 
     // Initialize root directory
     root_directory.setFilename("/");
@@ -36,22 +50,59 @@ FileSystem::FileSystem(const std::string& file_name, uint32_t total_blocks, uint
     root_directory.setStartBlock(superblock.root_dir_start);
     root_directory.setAttribute(ATTR_DIRECTORY);
 
+    // A journal left over from an earlier image must not replay onto this one
+    initJournal(file_name);
+    std::remove(journalPath().c_str());
+
     this->save_filesystem(file_name);
 
 }
 
-FileSystem::FileSystem(const std::string& file_name) {
+// With cache_blocks set, block data stays in the image and only that many
+// blocks are held in memory at a time, read and written back through the
+// given backend
+FileSystem::FileSystem(const std::string& file_name, uint32_t cache_blocks, IOBackend backend) {
+    mounted_root = &root_directory;
+    read_only = false;
+    share_epoch = 1;
+    shared_generation = 0;
+    cache_capacity = cache_blocks;
+    io_backend = backend;
+    initJournal(file_name);
     load_filesystem(file_name);
+    replayJournal();
 }
 
+// Write the image to a temporary file first, so a crash mid-save leaves the
+// previous image intact
 void FileSystem::save_filesystem(const std::string& filename) {
+    MetricTimer timer(HISTOGRAM_SAVE);
 
-    std::ofstream ofs(filename, std::ios::binary);
+    std::string temp_filename = filename + ".tmp";
+    std::ofstream ofs(temp_filename, std::ios::binary);
     if (!ofs.is_open()) {
         throw std::runtime_error("Failed to open file for saving filesystem");
     }
 
-    // Save the superblock
+    uint64_t block_offset = write_image(ofs);
+
+    ofs.close();
+    if (!ofs) {
+        throw std::runtime_error("Failed to write filesystem");
+    }
+    sync_and_rename(temp_filename, filename);
+
+    // The new image holds every block, so the cache can drop its spill
+    if (blocks.diskResident() && filename == image_name) {
+        blocks.rebind(filename, block_offset);
+    }
+}
+
+// Returns the offset of the block area in the written image
+uint64_t FileSystem::write_image(std::ostream& ofs) {
+    // Save the superblock, upgrading images loaded from an older layout
+    superblock.fat_start = sizeof(Superblock);
+    superblock.root_dir_start = superblock.fat_start + (superblock.total_blocks * sizeof(uint16_t));
     ofs.write(reinterpret_cast<const char*>(&superblock), sizeof(superblock));
 
     // Save the FAT
@@ -59,19 +110,45 @@ void FileSystem::save_filesystem(const std::string& filename) {
     ofs.write(reinterpret_cast<const char*>(&fat_size), sizeof(fat_size));
     ofs.write(reinterpret_cast<const char*>(fat.data()), fat_size * sizeof(uint16_t));
 
-    // Save the root directory and its children recursively
+    // Save the directory tree (see metadata.h)
     write_directory(ofs, root_directory);
 
     // Save disk blocks
-    for (const DiskBlock& block : blocks) {
-        // Write block data
-        ofs.write(block.data.data(), superblock.block_size);
+    uint64_t block_offset = ofs.tellp();
+    if (blocks.diskResident()) {
+        for (uint32_t i = 0; i < superblock.total_blocks; ++i) {
+            ofs.write(blocks.pin(i, false), superblock.block_size);
+            blocks.unpin(i);
+        }
+    } else {
+        ofs.write(blocks.residentData(), static_cast<size_t>(superblock.total_blocks) * superblock.block_size);
     }
 
-    ofs.close();
+    // Save the block reference counts
+    write_section(ofs, SECTION_REFCOUNTS, std::string(reinterpret_cast<const char*>(refcounts.data()), refcounts.size() * sizeof(uint32_t)));
+
+    // Save the snapshots
+    if (!snapshots.empty()) {
+        write_section(ofs, SECTION_SNAPSHOTS, serializeSnapshots());
+    }
+
+    // Save the block checksums
+    write_section(ofs, SECTION_CHECKSUMS, std::string(reinterpret_cast<const char*>(block_checksums.data()), block_checksums.size() * sizeof(uint32_t)));
+
+    // Save the block generations; entry generations are in the tree records
+    write_section(ofs, SECTION_BLOCK_GENERATIONS, std::string(reinterpret_cast<const char*>(block_generations.data()), block_generations.size() * sizeof(uint32_t)));
+    return block_offset;
+}
+
+void FileSystem::write_section(std::ostream& ofs, uint32_t tag, const std::string& payload) {
+    uint32_t length = payload.size();
+    ofs.write(reinterpret_cast<const char*>(&tag), sizeof(tag));
+    ofs.write(reinterpret_cast<const char*>(&length), sizeof(length));
+    ofs.write(payload.data(), length);
 }
 
-void FileSystem::write_directory(std::ofstream& ofs, const DirectoryEntry& directory) {
+// Save the fields of a single entry, without its children
+void FileSystem::write_entry(std::ostream& ofs, const DirectoryEntry& directory) {
     // Save filename length and content
     uint32_t filename_length = directory.getFilename().size();
     ofs.write(reinterpret_cast<const char*>(&filename_length), sizeof(filename_length));
@@ -105,49 +182,208 @@ void FileSystem::write_directory(std::ofstream& ofs, const DirectoryEntry& direc
     // Save attribute
     uint8_t attribute = directory.getAttribute();
     ofs.write(reinterpret_cast<const char*>(&attribute), sizeof(attribute));
-
-    // Save the number of children
-    uint32_t num_children = directory.children.size();
-    ofs.write(reinterpret_cast<const char*>(&num_children), sizeof(num_children));
-
-    // Recursively save each child
-    for (const auto& child : directory.children) {
-        write_directory(ofs, child);
-    }
 }
 
 
 void FileSystem::load_filesystem(const std::string& filename) {
+    MetricTimer timer(HISTOGRAM_LOAD);
     std::ifstream ifs(filename, std::ios::binary);
     if (!ifs.is_open()) {
         throw std::runtime_error("Failed to open file for loading filesystem");
     }
 
-    // Load the superblock
-    ifs.read(reinterpret_cast<char*>(&superblock), sizeof(superblock));
+    // Load the superblock. Older images hold only its leading fields.
+    superblock = Superblock();
+    ifs.read(reinterpret_cast<char*>(&superblock), LEGACY_SUPERBLOCK_SIZE);
+    uint32_t stored_size = LEGACY_SUPERBLOCK_SIZE;
+    if (superblock.fat_start > LEGACY_SUPERBLOCK_SIZE) {
+        stored_size = std::min<uint32_t>(superblock.fat_start, sizeof(Superblock));
+        ifs.read(reinterpret_cast<char*>(&superblock) + LEGACY_SUPERBLOCK_SIZE, stored_size - LEGACY_SUPERBLOCK_SIZE);
+        ifs.seekg(superblock.fat_start);
+    }
+    if (superblock.generation == 0) {
+        superblock.generation = 1;
+    }
+    if (!ifs || superblock.block_size == 0 || superblock.block_size > 64 * 1024 ||
+        superblock.total_blocks == 0 || superblock.total_blocks >= FAT_EOC) {
+        throw std::runtime_error("Corrupt superblock in " + filename);
+    }
+    kernels = &select_block_kernels(superblock.block_size);
 
     // Load the FAT
     uint32_t fat_size;
     ifs.read(reinterpret_cast<char*>(&fat_size), sizeof(fat_size));
+    if (fat_size != superblock.total_blocks) {
+        throw std::runtime_error("FAT size does not match the superblock in " + filename);
+    }
     fat.resize(fat_size);
     ifs.read(reinterpret_cast<char*>(fat.data()), fat_size * sizeof(uint16_t));
 
-    // Load the root directory and its children recursively
+    // Load the directory tree
     read_directory(ifs, root_directory);
 
-    // Load disk blocks
-    blocks.resize(superblock.total_blocks);
-    for (size_t i = 0; i < superblock.total_blocks; ++i) {
-        // Read block data
-        blocks[i].data.resize(superblock.block_size);
-        ifs.read(blocks[i].data.data(), superblock.block_size);
+    // Load disk blocks, or leave them in the image for the buffer cache
+    uint64_t block_area_size = static_cast<uint64_t>(superblock.total_blocks) * superblock.block_size;
+    if (cache_capacity > 0) {
+        uint64_t block_offset = ifs.tellg();
+        ifs.seekg(block_offset + block_area_size);
+        uint32_t capacity = std::min(std::max(cache_capacity, MIN_CACHE_BLOCKS), superblock.total_blocks);
+        blocks.initDisk(filename, block_offset, superblock.total_blocks, superblock.block_size, capacity, io_backend);
+    } else {
+        blocks.initMemory(superblock.total_blocks, superblock.block_size);
+        ifs.read(blocks.residentData(), block_area_size);
+    }
+
+    // Load the optional sections that follow the block area
+    bool has_refcounts = false;
+    bool has_checksums = false;
+    block_generations.assign(superblock.total_blocks, 0);
+    uint32_t tag;
+    uint32_t length;
+    while (ifs.read(reinterpret_cast<char*>(&tag), sizeof(tag)) && ifs.read(reinterpret_cast<char*>(&length), sizeof(length))) {
+        std::string payload(length, '\0');
+        if (!ifs.read(&payload[0], length)) {
+            break;
+        }
+
+        if (tag == SECTION_REFCOUNTS && length == superblock.total_blocks * sizeof(uint32_t)) {
+            refcounts.resize(superblock.total_blocks);
+            std::memcpy(refcounts.data(), payload.data(), length);
+            has_refcounts = true;
+        } else if (tag == SECTION_SNAPSHOTS) {
+            deserializeSnapshots(payload, snapshots);
+        } else if (tag == SECTION_CHECKSUMS && length == superblock.total_blocks * sizeof(uint32_t)) {
+            block_checksums.resize(superblock.total_blocks);
+            std::memcpy(block_checksums.data(), payload.data(), length);
+            has_checksums = true;
+        } else if (tag == SECTION_BLOCK_GENERATIONS && length == superblock.total_blocks * sizeof(uint32_t)) {
+            std::memcpy(block_generations.data(), payload.data(), length);
+        } else if (tag == SECTION_ENTRY_GENERATIONS) {
+            const uint32_t* generations = reinterpret_cast<const uint32_t*>(payload.data());
+            applyEntryGenerations(root_directory, generations, generations + length / sizeof(uint32_t));
+        }
+    }
+
+    // Older images carry no reference counts, so derive them from the tree
+    if (!has_refcounts) {
+        refcounts.assign(superblock.total_blocks, 0);
+        rebuildRefcounts(root_directory);
+        for (const Snapshot& snapshot : snapshots) {
+            rebuildRefcounts(snapshot.root);
+        }
+    }
+
+    // Older images carry no checksums; take the blocks as they are now
+    if (!has_checksums) {
+        block_checksums.resize(superblock.total_blocks);
+        for (uint32_t i = 0; i < superblock.total_blocks; ++i) {
+            updateChecksum(i);
+        }
+    }
+
+    // Older images carry no volume counters and only sum direct children
+    // into directory sizes
+    if (stored_size < sizeof(Superblock)) {
+        rebuildVolumeCounters();
     }
 
     ifs.close();
 }
 
+// Count one reference per entry start block and one per FAT link, walking
+// each shared chain suffix only once
+void FileSystem::rebuildRefcounts(const DirectoryEntry& directory) {
+    for (const auto& entry : directory.children) {
+        if (is_directory(entry)) {
+            rebuildRefcounts(entry);
+            continue;
+        }
+
+        uint16_t block = entry.getStartBlock();
+        if (!isChainBlock(block) || ++refcounts[block] > 1) {
+            continue;
+        }
+        while (isChainBlock(fat[block])) {
+            block = fat[block];
+            if (++refcounts[block] > 1) {
+                break;
+            }
+        }
+    }
+}
+
+bool FileSystem::isChainBlock(uint16_t block) const {
+    return block != 0 && block < fat.size() && fat[block] != FAT_FREE;
+}
+
+// Derive the volume counters and recursive directory sizes from scratch
+void FileSystem::rebuildVolumeCounters() {
+    superblock.free_blocks = std::count(fat.begin(), fat.end(), FAT_FREE);
+    superblock.num_files = countFiles(root_directory);
+    superblock.num_directories = countDirectories(root_directory);
+    calculateDirectorySize(root_directory);
+    for (Snapshot& snapshot : snapshots) {
+        calculateDirectorySize(snapshot.root);
+    }
+    modified = true;
+}
+
+/*
+GENERATIONS
+Every change is stamped with the open generation, so export_delta can find
+what changed after a given generation without scanning data.
+*/
+
+void FileSystem::markBlock(uint16_t block) {
+    block_generations[block] = superblock.generation;
+    modified = true;
+}
+
+void FileSystem::updateChecksum(uint16_t block) {
+    block_checksums[block] = kernels->checksum(blocks.pin(block, false), superblock.block_size);
+    blocks.unpin(block);
+}
+
+bool FileSystem::verifyBlock(uint16_t block) const {
+    bool valid = block_checksums[block] == kernels->checksum(blocks.pin(block, false), superblock.block_size);
+    blocks.unpin(block);
+    return valid;
+}
+
+// Record a change to an entry's own fields or to its list of children
+void FileSystem::touchEntry(DirectoryEntry& entry) {
+    entry.setGeneration(superblock.generation);
+    modified = true;
+}
+
+// Record that an entry was created or moved under its current parent
+void FileSystem::linkEntry(DirectoryEntry& entry) {
+    entry.setGeneration(superblock.generation);
+    entry.setLinkGeneration(superblock.generation);
+    modified = true;
+}
 
-void FileSystem::read_directory(std::ifstream& ifs, DirectoryEntry& directory) {
+// Record that chains may have become shared, so no cached tail is trusted
+void FileSystem::markShared() {
+    share_epoch++;
+    shared_generation = superblock.generation;
+}
+
+// Record that the child 'name' was removed from a directory
+void FileSystem::unlinkEntry(DirectoryEntry& directory, const std::string& name) {
+    directory.logRemoval(name, superblock.generation, journaled_generation);
+    touchEntry(directory);
+}
+
+// Close the open generation and return it. Called at the points a delta or
+// snapshot is taken, so changes made afterwards compare newer.
+uint32_t FileSystem::advanceGeneration() {
+    return superblock.generation++;
+}
+
+
+// Load the fields of a single entry, without its children
+void FileSystem::read_entry(std::istream& ifs, DirectoryEntry& directory) {
     // Load filename length and content
     uint32_t filename_length;
     ifs.read(reinterpret_cast<char*>(&filename_length), sizeof(filename_length));
@@ -191,15 +427,19 @@ void FileSystem::read_directory(std::ifstream& ifs, DirectoryEntry& directory) {
     uint8_t attribute;
     ifs.read(reinterpret_cast<char*>(&attribute), sizeof(attribute));
     directory.setAttribute(attribute);
+}
 
-    // Load the number of children
-    uint32_t num_children;
-    ifs.read(reinterpret_cast<char*>(&num_children), sizeof(num_children));
-    
-    // Recursively load each child
-    directory.children.resize(num_children);
+// Images written before the fixed-layout tree store entry generations apart
+// from it, as (generation, link generation) pairs in preorder
+void FileSystem::applyEntryGenerations(DirectoryEntry& directory, const uint32_t*& generations, const uint32_t* end) {
+    if (end - generations < 2) {
+        return;
+    }
+    directory.setGeneration(*generations++);
+    directory.setLinkGeneration(*generations++);
+    directory.setUnlinkGeneration(directory.getGeneration()); // Removals were not tracked
     for (auto& child : directory.children) {
-        read_directory(ifs, child);
+        applyEntryGenerations(child, generations, end);
     }
 }
 
@@ -212,7 +452,7 @@ void FileSystem::dir(const std::string& path) {
     // Check if path is the root directory
     if (path == "/") {
         std::cout << "Directory listing for root directory:" << std::endl;
-        ls_directory(root_directory);
+        ls_directory(*mounted_root);
         return;
     }
 
@@ -275,8 +515,10 @@ void FileSystem::ls_directory(const DirectoryEntry& directory) {
 
 
 DirectoryEntry* FileSystem::findDirectory(const std::string& path) {
-    
-    DirectoryEntry* current_directory = &root_directory;
+    MetricTimer timer(HISTOGRAM_LOOKUP);
+    count_metric(COUNTER_LOOKUPS);
+
+    DirectoryEntry* current_directory = mounted_root;
 
     // Split the path into components
     std::stringstream ss(path);
@@ -285,13 +527,16 @@ DirectoryEntry* FileSystem::findDirectory(const std::string& path) {
         if (component.empty()) continue;
 
         bool found = false;
+        uint64_t scanned = 0;
         for (DirectoryEntry& entry : current_directory->children) {
+            scanned++;
             if (entry.getFilename() == component && (entry.getAttribute() & ATTR_DIRECTORY)) {
                 current_directory = &entry;
                 found = true;
                 break;
             }
         }
+        count_metric(COUNTER_ENTRIES_SCANNED, scanned);
 
         // If the directory doesn't exist, return nullptr
         if (!found) {
@@ -305,6 +550,10 @@ DirectoryEntry* FileSystem::findDirectory(const std::string& path) {
 
 
 void FileSystem::mkdir(const std::string& path) {
+    if (!checkWritable()) {
+        return;
+    }
+
     // Parse the input path to extract the directory path and new directory name
     std::string directory_path = extract_directory_path(path);
     std::string dir_name = extract_filename(path);
@@ -338,11 +587,18 @@ void FileSystem::mkdir(const std::string& path) {
     new_directory.setStartBlock(FAT_EOC);
 
     // Add the new directory entry to the parent directory's children
+    linkEntry(new_directory);
+    touchEntry(*parent_directory);
+    superblock.num_directories++;
     parent_directory->children.push_back(new_directory); // Move new_directory into the vector
 }
 
 
 void FileSystem::rmdir(const std::string& path) {
+    if (!checkWritable()) {
+        return;
+    }
+
     // Find the parent directory of the directory to be removed
     std::string parentPath = extract_directory_path(path);
     std::string dirName = extract_filename(path);
@@ -358,7 +614,17 @@ void FileSystem::rmdir(const std::string& path) {
         if (it->getFilename() == dirName) {
             // Check if the entry is a directory
             if (it->getAttribute() & ATTR_DIRECTORY) {
+                // Release every file in the subtree in one batch; the subtree
+                // itself goes away with its entry
+                std::vector<uint16_t> start_blocks;
+                collectChains(*it, start_blocks);
+                releaseChains(start_blocks);
+                superblock.num_files -= start_blocks.size();
+                superblock.num_directories -= countDirectories(*it);
+                int64_t removed_size = it->getSize();
                 parentDirectory->children.erase(it);
+                adjustDirectorySizes(parentPath, -removed_size);
+                unlinkEntry(*parentDirectory, dirName);
                 std::cout << "Directory removed: " << path << std::endl;
                 return;
             } else {
@@ -379,27 +645,45 @@ void FileSystem::dumpe2fs() {
     std::cout << "Filesystem Information:" << std::endl;
     std::cout << "Block Count: " << superblock.total_blocks << std::endl;
     std::cout << "Block Size: " << superblock.block_size << " bytes" << std::endl;
-
-    // Count free blocks
-    uint32_t free_blocks = 0;
-    for (uint16_t block : fat) {
-        if (block == FAT_FREE) {
-            free_blocks++;
-        }
+    std::cout << "Generation: " << superblock.generation << std::endl;
+
+    // The counters are kept up to date by every operation
+    std::cout << "Free Blocks: " << superblock.free_blocks << std::endl;
+    std::cout << "Number of Files: " << superblock.num_files << std::endl;
+    std::cout << "Number of Directories: " << superblock.num_directories << std::endl;
+    std::cout << "Bytes Used by Files: " << root_directory.getSize() << std::endl;
+    std::cout << "Number of Snapshots: " << snapshots.size() << std::endl;
+    if (blocks.diskResident()) {
+        std::cout << "Buffer Cache: " << blocks.capacity() << " blocks (disk-resident)" << std::endl;
     }
-    std::cout << "Free Blocks: " << free_blocks << std::endl;
-
-    // Count number of files and directories
-    uint32_t num_files = countFiles(root_directory);
-    uint32_t num_directories = countDirectories(root_directory);
-    std::cout << "Number of Files: " << num_files << std::endl;
-    std::cout << "Number of Directories: " << num_directories << std::endl;
 
     // List occupied blocks and corresponding filenames
     std::cout << "Occupied Blocks:" << std::endl;
     listOccupiedBlocks(root_directory);
 }
 
+void FileSystem::print_cache_stats() {
+    if (!blocks.diskResident()) {
+        std::cout << "Buffer Cache: all " << superblock.total_blocks << " blocks resident" << std::endl;
+        return;
+    }
+
+    uint64_t lookups = blocks.hits + blocks.misses;
+    std::cout << "Buffer Cache: " << blocks.capacity() << " of " << superblock.total_blocks << " blocks" << std::endl;
+    std::cout << "Cache Hits: " << blocks.hits << std::endl;
+    std::cout << "Cache Misses: " << blocks.misses << std::endl;
+    std::cout << "Cache Hit Rate: " << (lookups > 0 ? 100.0 * blocks.hits / lookups : 0) << "%" << std::endl;
+    std::cout << "Cache Evictions: " << blocks.evictions << std::endl;
+    std::cout << "Cache Write-backs: " << blocks.writebacks << std::endl;
+    std::cout << "Readahead Blocks: " << blocks.readahead_blocks << std::endl;
+    if (blocks.io.usingIoUring()) {
+        std::cout << "I/O Backend: io_uring (queue depth " << blocks.io.queueDepth() << ")" << std::endl;
+    } else {
+        std::cout << "I/O Backend: pread/pwrite" << std::endl;
+    }
+    std::cout << "I/O Batches: " << blocks.io.batches << " (" << blocks.io.requests_run << " requests)" << std::endl;
+}
+
 // Helper function to count files recursively
 uint32_t FileSystem::countFiles(const DirectoryEntry& directory) {
     uint32_t count = 0;
@@ -435,82 +719,326 @@ void FileSystem::listOccupiedBlocks(const DirectoryEntry& directory) {
     }
 }
 
-void FileSystem::allocateBlocksForFile(DirectoryEntry& entry, uint32_t file_size) {
-    // Calculate the number of blocks needed for the file
-    uint32_t num_blocks_needed = (file_size + superblock.block_size - 1) / superblock.block_size;
+// Give the entry a chain for file_size bytes, placed near 'goal'. Nothing
+// is allocated if the image cannot hold the whole file.
+bool FileSystem::allocateBlocksForFile(DirectoryEntry& entry, uint32_t file_size, uint16_t goal) {
+    MetricTimer timer(HISTOGRAM_ALLOCATE);
 
-    // Find the next free block and assign it as the start block
-    uint16_t start_block = findNextFreeBlock();
-    if (start_block == FAT_FREE) {
+    // Calculate the number of blocks needed for the file; an empty file still gets one
+    uint32_t num_blocks_needed = kernels->chain_blocks(file_size, superblock.block_size);
+
+    std::vector<uint16_t> allocated;
+    if (!allocateBlocks(num_blocks_needed, goal, allocated)) {
         std::cerr << "Error: Insufficient free blocks to allocate for file." << std::endl;
-        return;
+        return false;
     }
-    entry.setStartBlock(start_block);
 
-    // Allocate the remaining blocks for the file
-    uint16_t prev_block = start_block;
-    for (uint32_t i = 1; i < num_blocks_needed; ++i) {  // Change <= to <
-        uint16_t free_block = findNextFreeBlock();
-        if (free_block == FAT_FREE) {
-            std::cerr << "Error: Insufficient free blocks to allocate for file." << std::endl;
-            return;
+    // Link the blocks and mark the last one as the end of the chain
+    for (size_t i = 0; i < allocated.size(); ++i) {
+        fat[allocated[i]] = i + 1 < allocated.size() ? allocated[i + 1] : FAT_EOC;
+        refcounts[allocated[i]] = 1;
+    }
+    entry.setStartBlock(allocated.front());
+    return true;
+}
+
+// Allocate 'count' blocks, preferring one contiguous run at or after 'goal'.
+// Without such a run the free blocks nearest after the goal are taken, in
+// order. Returns false, with nothing allocated, if too few blocks are free.
+bool FileSystem::allocateBlocks(uint32_t count, uint16_t goal, std::vector<uint16_t>& allocated) {
+    if (count > superblock.free_blocks) {
+        return false;
+    }
+
+    std::vector<uint16_t> chosen;
+    uint16_t run = findFreeRun(count, goal);
+    if (run != FAT_FREE) {
+        for (uint32_t i = 0; i < count; ++i) {
+            chosen.push_back(run + i);
+        }
+    } else {
+        uint32_t usable = fat.size() - 1; // Block 0 is never used
+        uint32_t first = goal >= 1 && goal < fat.size() ? goal - 1 : 0;
+        for (uint32_t i = 0; i < usable && chosen.size() < count; ++i) {
+            uint16_t block = 1 + (first + i) % usable;
+            if (fat[block] == FAT_FREE) {
+                chosen.push_back(block);
+            }
+        }
+        if (chosen.size() < count) {
+            return false;
         }
-        fat[prev_block] = free_block;
-        prev_block = free_block;
     }
 
-    // Mark the last block as the end of the chain
-    fat[prev_block] = FAT_EOC;
+    for (uint16_t block : chosen) {
+        claimBlock(block);
+    }
+    allocated.insert(allocated.end(), chosen.begin(), chosen.end());
+    return true;
+}
 
-/*
-    
-    // Debug output for FAT entries related to this file
-    uint16_t current_block = start_block;
-    while (current_block != FAT_EOC && current_block != FAT_FREE) {
-        std::cout << "Block " << current_block << " -> " << fat[current_block] << std::endl;
-        current_block = fat[current_block];
+// First run of 'count' free blocks starting at or after 'goal', wrapping
+// around to the start of the image. Returns FAT_FREE if there is none.
+uint16_t FileSystem::findFreeRun(uint32_t count, uint16_t goal) const {
+    if (goal < 1 || goal >= fat.size()) {
+        goal = 1;
     }
-  */  
 
+    // Runs starting from the goal, then runs starting before it
+    uint32_t ranges[2][2] = {{goal, static_cast<uint32_t>(fat.size())}, {1, goal}};
+    for (auto& range : ranges) {
+        uint32_t run_length = 0;
+        for (uint32_t block = range[0]; block < fat.size(); ++block) {
+            if (fat[block] != FAT_FREE) {
+                run_length = 0;
+                if (block >= range[1]) {
+                    break;
+                }
+                continue;
+            }
+            run_length++;
+            if (run_length == count) {
+                return block + 1 - count;
+            }
+        }
+    }
+    return FAT_FREE;
+}
+
+// Take a free block out of the free pool
+void FileSystem::claimBlock(uint16_t block) {
+    fat[block] = FAT_USED;
+    superblock.free_blocks--;
+    count_metric(COUNTER_BLOCKS_ALLOCATED);
+    markBlock(block);
 }
 
-uint16_t FileSystem::findNextFreeBlock() {
-    for (uint16_t i = 1; i < fat.size(); ++i) { // Start from 1 to avoid using block 0
-        if (fat[i] == FAT_FREE) {
-            fat[i] = FAT_USED; // Mark the block as used
-            return i;
+// Where a new file in the directory should go: after its most recently
+// added sibling file, so a directory's files stay close together
+uint16_t FileSystem::allocationGoal(const DirectoryEntry& directory) const {
+    for (auto it = directory.children.rbegin(); it != directory.children.rend(); ++it) {
+        if (!(it->getAttribute() & ATTR_DIRECTORY) && isChainBlock(it->getStartBlock())) {
+            return it->getStartBlock();
         }
     }
-    return FAT_FREE; // Indicate no free block found
+    return 1;
 }
 
 
 void FileSystem::deallocateBlocksForFile(const DirectoryEntry& entry) {
-    uint16_t block = entry.getStartBlock();
-    while (block != FAT_EOC && block != 0) {
-        uint16_t next_block = fat[block];
-        // Optionally clear the block data (to prevent residual data issues)
-        // Overwrite the block data with null characters
-        std::fill(blocks[block].data.begin(), blocks[block].data.end(), '\0');
+    releaseChain(entry.getStartBlock());
+}
+
+// Drop one reference to a chain. Blocks are freed only while their count
+// reaches zero; the first block still referenced elsewhere (a copy made by
+// cp) keeps itself and the rest of the chain alive.
+void FileSystem::releaseChain(uint16_t start_block) {
+    releaseChains(std::vector<uint16_t>(1, start_block));
+}
+
+// Drop one reference on each chain. Chains are walked with the FAT still
+// intact and the blocks whose count reached zero are freed together
+// afterwards. Freed blocks keep their old data; readers never look past a
+// file's size and write clears the tail of a file's last block.
+void FileSystem::releaseChains(const std::vector<uint16_t>& start_blocks) {
+    std::vector<uint16_t> freed;
+    for (uint16_t block : start_blocks) {
+        while (block != FAT_EOC && block != 0 && block < fat.size() && fat[block] != FAT_FREE) {
+            markBlock(block);
+            if (refcounts[block] > 1) {
+                refcounts[block]--;
+                break;
+            }
+            if (refcounts[block] == 0) {
+                break; // Already released by an earlier chain in this batch
+            }
+            refcounts[block] = 0;
+            freed.push_back(block);
+            block = fat[block];
+            count_metric(COUNTER_FAT_HOPS);
+        }
+    }
+
+    for (uint16_t block : freed) {
         fat[block] = FAT_FREE; // Mark the block as free
-        block = next_block;
+    }
+    superblock.free_blocks += freed.size();
+    count_metric(COUNTER_BLOCKS_FREED, freed.size());
+}
+
+// Collect the start block of every file below the directory
+void FileSystem::collectChains(const DirectoryEntry& directory, std::vector<uint16_t>& start_blocks) {
+    for (const auto& entry : directory.children) {
+        if (is_directory(entry)) {
+            collectChains(entry, start_blocks);
+        } else {
+            start_blocks.push_back(entry.getStartBlock());
+        }
     }
 }
 
-void FileSystem::calculateDirectorySize(DirectoryEntry& directory) {
+// Make block 'block_index' of the entry's chain private to that entry so it
+// can be modified in place. Shared blocks from the first shared one up to the
+// requested one are copied; the rest of the chain stays shared.
+// Returns the writable block, or FAT_FREE if the chain is too short or the
+// image is full.
+uint16_t FileSystem::unshareBlock(DirectoryEntry& entry, uint32_t block_index) {
+    std::vector<uint16_t> path;
+    uint16_t block = entry.getStartBlock();
+    while (isChainBlock(block) && path.size() <= block_index) {
+        path.push_back(block);
+        block = fat[block];
+    }
+    if (path.size() <= block_index) {
+        return FAT_FREE;
+    }
+
+    size_t first_shared = 0;
+    while (first_shared < path.size() && refcounts[path[first_shared]] == 1) {
+        first_shared++;
+    }
+    if (first_shared == path.size()) {
+        return path[block_index];
+    }
+
+    // Copy the shared run into fresh blocks, right after the private prefix
+    std::vector<uint16_t> copies;
+    uint16_t goal = first_shared > 0 ? path[first_shared - 1] + 1 : path[first_shared];
+    if (!allocateBlocks(path.size() - first_shared, goal, copies)) {
+        std::cerr << "Error: Insufficient free blocks to copy shared file data." << std::endl;
+        return FAT_FREE;
+    }
+    for (size_t i = 0; i < copies.size(); ++i) {
+        uint16_t copy = copies[i];
+        uint16_t original = path[first_shared + i];
+        kernels->copy(blocks.pinForOverwrite(copy), blocks.pin(original, false), superblock.block_size);
+        blocks.unpin(original);
+        blocks.unpin(copy);
+        count_metric(COUNTER_BLOCKS_COPIED);
+        block_checksums[copy] = block_checksums[original];
+        refcounts[copy] = 1;
+        if (i > 0) {
+            fat[copies[i - 1]] = copy;
+        }
+    }
+
+    // The last copy links back into the original chain, which gains a reference
+    uint16_t successor = fat[path.back()];
+    fat[copies.back()] = successor;
+    if (isChainBlock(successor)) {
+        refcounts[successor]++;
+        markBlock(successor);
+    }
+
+    // Point the private prefix at the copies and drop our share of the original run
+    if (first_shared == 0) {
+        entry.setStartBlock(copies.front());
+        touchEntry(entry);
+    } else {
+        fat[path[first_shared - 1]] = copies.front();
+        markBlock(path[first_shared - 1]);
+    }
+    refcounts[path[first_shared]]--;
+    markBlock(path[first_shared]);
+
+    return copies.back();
+}
+
+// Load the next 'count' blocks of a chain, starting at 'block', into the cache
+void FileSystem::prefetchChain(uint16_t block, uint32_t count) {
+    std::vector<uint16_t> chain;
+    while (chain.size() < count && isChainBlock(block)) {
+        chain.push_back(block);
+        block = fat[block];
+    }
+    blocks.readahead(chain);
+}
+
+// The block state the chain kernels read and update
+ChainState FileSystem::chainState() {
+    return ChainState{&blocks, fat.data(), static_cast<uint32_t>(fat.size()), block_checksums.data(),
+                      block_generations.data(), superblock.generation, blocks.diskResident() ? READAHEAD_BLOCKS : 0};
+}
+
+// Recompute the size of a directory as the bytes of every file below it.
+// Operations keep these totals current with adjustDirectorySizes instead.
+uint32_t FileSystem::calculateDirectorySize(DirectoryEntry& directory) {
     uint32_t totalSize = 0;
 
-    for (const auto& entry : directory.children) {
-        if (!is_directory(entry)) 
+    for (auto& entry : directory.children) {
+        if (is_directory(entry)) {
+            totalSize += calculateDirectorySize(entry);
+        } else {
             // Add the size of the file
             totalSize += entry.getSize();
         }
+    }
+
+    if (directory.getSize() != totalSize) {
+        directory.setSize(totalSize);
+        touchEntry(directory);
+    }
+    return totalSize;
+}
+
+// Add delta bytes to every directory from the root down to the given one
+void FileSystem::adjustDirectorySizes(const std::string& path, int64_t delta) {
+    if (delta == 0) {
+        return;
+    }
+
+    DirectoryEntry* directory = &root_directory;
+    std::vector<std::string> components = split_path(path);
+    for (size_t i = 0; directory != nullptr; ++i) {
+        directory->setSize(static_cast<uint32_t>(directory->getSize() + delta));
+        touchEntry(*directory);
+        if (i == components.size()) {
+            break;
+        }
+
+        DirectoryEntry* next = nullptr;
+        for (auto& child : directory->children) {
+            if (child.getFilename() == components[i] && is_directory(child)) {
+                next = &child;
+                break;
+            }
+        }
+        directory = next;
+    }
+}
+
+// Entry at a path, file or directory, or nullptr
+DirectoryEntry* FileSystem::findEntry(const std::string& path) {
+    std::string name = extract_filename(path);
+    if (name.empty()) {
+        return findDirectory(path);
+    }
+    DirectoryEntry* parent = findDirectory(extract_directory_path(path));
+    if (parent != nullptr) {
+        for (auto& child : parent->children) {
+            if (child.getFilename() == name) {
+                return &child;
+            }
+        }
+    }
+    return nullptr;
+}
 
-    directory.setSize(totalSize);
+void FileSystem::du(const std::string& path) {
+    DirectoryEntry* entry = findEntry(path);
+    if (entry == nullptr) {
+        std::cerr << "Error: Path not found: " << path << std::endl;
+        return;
+    }
+    std::cout << entry->getSize() << "\t" << path << std::endl;
 }
 
 
 void FileSystem::write(const std::string& path, const std::string& linux_file) {
+    if (!checkWritable()) {
+        return;
+    }
+
     // Parse the provided path to determine the directory where the new file should be created
     std::string parent_directory_path = extract_directory_path(path);
     DirectoryEntry* parent_directory = findDirectory(parent_directory_path);
@@ -548,27 +1076,25 @@ void FileSystem::write(const std::string& path, const std::string& linux_file) {
     setPermissionsFromLinuxFile(new_file, linux_file);
     set_file_metadata(linux_file,new_file);
 
-    // Allocate blocks for the new file
-    allocateBlocksForFile(new_file, new_file.getSize());
+    // Allocate blocks for the new file next to its siblings
+    if (!allocateBlocksForFile(new_file, new_file.getSize(), allocationGoal(*parent_directory))) {
+        return;
+    }
 
     // Write the contents of the Linux file into the blocks allocated for the new file
-    uint32_t remaining_bytes = new_file.getSize();
-    uint32_t current_block = new_file.getStartBlock();
-
-    while (remaining_bytes > 0 && current_block != FAT_EOC) {
-        DiskBlock& block = blocks[current_block];
-        uint32_t bytes_to_write = std::min(remaining_bytes, superblock.block_size);
-        linux_ifs.read(reinterpret_cast<char*>(block.data.data()), bytes_to_write);
-        remaining_bytes -= bytes_to_write;
-        current_block = fat[current_block];
-    }
+    uint32_t written_blocks = kernels->fill_chain(chainState(), new_file.getStartBlock(), linux_ifs, new_file.getSize(), superblock.block_size);
+    count_metric(COUNTER_BYTES_WRITTEN, new_file.getSize());
+    count_metric(COUNTER_FAT_HOPS, written_blocks);
     // Close the Linux file
     linux_ifs.close();
 
     // Add the new file to the parent directory
+    linkEntry(new_file);
     parent_directory->children.push_back(new_file);
+    touchEntry(*parent_directory);
+    superblock.num_files++;
 
-    calculateDirectorySize(*parent_directory);
+    adjustDirectorySizes(parent_directory_path, new_file.getSize());
 
 }
 
@@ -675,17 +1201,15 @@ void FileSystem::read(const std::string& path, const std::string& linux_file) {
     }
 
     // Read the file contents from the blocks and write them to the Linux file
-    uint32_t remaining_bytes = entry->getSize();
-    uint16_t current_block = entry->getStartBlock();
-    
-
-    while (remaining_bytes > 0 && current_block != FAT_EOC){
-        DiskBlock& block = blocks[current_block];
-        uint32_t bytes_to_read = std::min(remaining_bytes, superblock.block_size);
-        ofs.write(block.data.data(), bytes_to_read);
-        remaining_bytes -= bytes_to_read;
-        current_block = fat[current_block];
+    uint16_t bad_block = kernels->drain_chain(chainState(), entry->getStartBlock(), ofs, entry->getSize(), superblock.block_size);
+    if (bad_block != 0) {
+        std::cerr << "Error: Checksum mismatch in block " << bad_block << " of " << path << std::endl;
+        ofs.close();
+        std::remove(linux_file.c_str());
+        return;
     }
+    count_metric(COUNTER_BYTES_READ, entry->getSize());
+    count_metric(COUNTER_FAT_HOPS, entry->getSize() == 0 ? 0 : kernels->chain_blocks(entry->getSize(), superblock.block_size));
 
     ofs.close();
 
@@ -697,6 +1221,10 @@ void FileSystem::read(const std::string& path, const std::string& linux_file) {
 
 
 void FileSystem::del(const std::string& path) {
+    if (!checkWritable()) {
+        return;
+    }
+
     // Extract the parent directory path and the file name
     std::string parentDirectoryPath = extract_directory_path(path);
     std::string fileName = extract_filename(path);
@@ -721,8 +1249,12 @@ void FileSystem::del(const std::string& path) {
                 }
                 // Deallocate blocks occupied by the file
                 deallocateBlocksForFile(*it);
+                int64_t file_size = it->getSize();
                 // Remove the file entry from the parent directory's list of children
                 it = parentDirectory->children.erase(it);
+                unlinkEntry(*parentDirectory, fileName);
+                superblock.num_files--;
+                adjustDirectorySizes(parentDirectoryPath, -file_size);
                 std::cout << "File deleted successfully." << std::endl;
                 return;
             } else {
@@ -737,7 +1269,157 @@ void FileSystem::del(const std::string& path) {
 }
 
 
+void FileSystem::cp(const std::string& source_path, const std::string& destination_path) {
+    if (!checkWritable()) {
+        return;
+    }
+
+    // Find the source file
+    DirectoryEntry* source_directory = findDirectory(extract_directory_path(source_path));
+    if (!source_directory) {
+        std::cerr << "Error: Source directory does not exist." << std::endl;
+        return;
+    }
+
+    std::string source_name = extract_filename(source_path);
+    DirectoryEntry* source = nullptr;
+    for (auto& child : source_directory->children) {
+        if (child.getFilename() == source_name && !is_directory(child)) {
+            source = &child;
+            break;
+        }
+    }
+
+    if (source == nullptr) {
+        std::cerr << "Error: File not found: " << source_name << std::endl;
+        return;
+    }
+
+    if (!checkPassword(*source)) {
+        std::cerr << "Error: Incorrect password." << std::endl;
+        return;
+    }
+
+    if (!(source->getPermissions().read)) {
+        std::cerr << "Error: File do not have a permission for reading: " << source_name << std::endl;
+        return;
+    }
+
+    // Take the copy before touching the destination, which may share the vector
+    DirectoryEntry new_file = *source;
+
+    DirectoryEntry* destination_directory = findDirectory(extract_directory_path(destination_path));
+    if (!destination_directory) {
+        std::cerr << "Error: Destination directory does not exist." << std::endl;
+        return;
+    }
+
+    std::string new_file_name = extract_filename(destination_path);
+    for (const auto& child : destination_directory->children) {
+        if (child.getFilename() == new_file_name) {
+            std::cerr << "Error: File with the same name already exists in the directory." << std::endl;
+            return;
+        }
+    }
+
+    // The copy shares the source chain; blocks are duplicated by unshareBlock
+    // only when one of the files is modified
+    new_file.setFilename(new_file_name);
+    new_file.setCreationTime(std::time(nullptr));
+    new_file.setModificationTime(std::time(nullptr));
+    if (isChainBlock(new_file.getStartBlock())) {
+        refcounts[new_file.getStartBlock()]++;
+        markBlock(new_file.getStartBlock());
+        markShared();
+    }
+
+    linkEntry(new_file);
+    destination_directory->children.push_back(new_file);
+    touchEntry(*destination_directory);
+    superblock.num_files++;
+    adjustDirectorySizes(extract_directory_path(destination_path), new_file.getSize());
+}
+
+
+void FileSystem::mv(const std::string& source_path, const std::string& destination_path) {
+    if (!checkWritable()) {
+        return;
+    }
+
+    std::vector<std::string> source_components = split_path(source_path);
+    std::vector<std::string> destination_components = split_path(destination_path);
+    if (source_components.empty() || destination_components.empty()) {
+        std::cerr << "Error: Cannot move the root directory." << std::endl;
+        return;
+    }
+
+    // Refuse to move a directory underneath itself
+    if (destination_components.size() > source_components.size() &&
+        std::equal(source_components.begin(), source_components.end(), destination_components.begin())) {
+        std::cerr << "Error: Cannot move a directory into itself." << std::endl;
+        return;
+    }
+
+    // Find the source entry
+    DirectoryEntry* source_directory = findDirectory(extract_directory_path(source_path));
+    if (!source_directory) {
+        std::cerr << "Error: Source directory does not exist." << std::endl;
+        return;
+    }
+
+    std::string source_name = extract_filename(source_path);
+    auto it = source_directory->children.begin();
+    while (it != source_directory->children.end() && it->getFilename() != source_name) {
+        ++it;
+    }
+    if (it == source_directory->children.end()) {
+        std::cerr << "Error: File not found: " << source_name << std::endl;
+        return;
+    }
+
+    if (!is_directory(*it) && !checkPassword(*it)) {
+        std::cerr << "Error: Incorrect password." << std::endl;
+        return;
+    }
+
+    // Validate the destination before changing anything
+    std::string destination_directory_path = extract_directory_path(destination_path);
+    DirectoryEntry* destination_directory = findDirectory(destination_directory_path);
+    if (!destination_directory) {
+        std::cerr << "Error: Destination directory does not exist." << std::endl;
+        return;
+    }
+
+    std::string new_name = extract_filename(destination_path);
+    for (const auto& child : destination_directory->children) {
+        if (child.getFilename() == new_name) {
+            std::cerr << "Error: File with the same name already exists in the directory." << std::endl;
+            return;
+        }
+    }
+
+    // Move the entry out; its children and blocks come along untouched
+    DirectoryEntry moved = std::move(*it);
+    moved.setFilename(new_name);
+    linkEntry(moved);
+    int64_t moved_size = moved.getSize();
+    source_directory->children.erase(it);
+    unlinkEntry(*source_directory, source_name);
+    adjustDirectorySizes(extract_directory_path(source_path), -moved_size);
+
+    // Erasing shifted the siblings, so resolve the destination again
+    destination_directory = findDirectory(destination_directory_path);
+    destination_directory->children.push_back(std::move(moved));
+    touchEntry(*destination_directory);
+    adjustDirectorySizes(destination_directory_path, moved_size);
+}
+
+
 void FileSystem::fs_chmod(const std::string& path, const std::string& permissions) {
+    if (!checkWritable()) {
+        return;
+    }
+
     // Extract the parent directory path and the file name
     std::string parentDirectoryPath = extract_directory_path(path);
     std::string fileName = extract_filename(path);
@@ -791,12 +1473,17 @@ void FileSystem::fs_chmod(const std::string& path, const std::string& permission
     }
 
     fileEntry->setPermissions(currentPermissions);
+    touchEntry(*fileEntry);
     fileEntry->setModificationTime(std::time(nullptr));
 }
 
 
     
 void FileSystem::addpw(const std::string& path, const std::string& password) {
+    if (!checkWritable()) {
+        return;
+    }
+
     // Extract the parent directory path and the file name
     std::string parentDirectoryPath = extract_directory_path(path);
     std::string fileName = extract_filename(path);
@@ -829,10 +1516,20 @@ void FileSystem::addpw(const std::string& path, const std::string& password) {
     }
 
     fileEntry->setPassword(password);
+    touchEntry(*fileEntry);
     fileEntry->setModificationTime(std::time(nullptr));
          
 }
 
+// Mutating operations are refused while a snapshot is mounted
+bool FileSystem::checkWritable() {
+    if (read_only) {
+        std::cerr << "Error: The mounted snapshot is read-only." << std::endl;
+        return false;
+    }
+    return true;
+}
+
 bool FileSystem::checkPassword(const DirectoryEntry& entry) {
     std::string storedPassword = entry.getPassword();
     if (storedPassword.empty()) {
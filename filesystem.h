@@ -3,7 +3,11 @@
 
 #include <ctime>
 #include <vector>
+#include <thread>
+#include <atomic>
 #include "directoryentry.h"
+#include "buffercache.h"
+#include "blockkernels.h"
 #include <iostream>
 
 struct Superblock {
@@ -11,39 +15,179 @@ struct Superblock {
     uint32_t fat_start;
     uint32_t root_dir_start;
     uint32_t block_size;
+    // Fields below were added later. fat_start records how much of the
+    // superblock an image holds; missing fields load as zero.
+    uint32_t generation;          // Open generation, stamped on every change
+    uint32_t snapshot_generation; // Generation of the last snapshot create/delete
+    // Volume counters kept up to date by every operation, for the live tree
+    uint32_t free_blocks;
+    uint32_t num_files;
+    uint32_t num_directories;
 };
 
+const uint32_t LEGACY_SUPERBLOCK_SIZE = 16;
 
-struct DiskBlock {
-    std::vector<char> data;          // Data stored in this block
+
+// Disk-resident mode: smallest buffer cache accepted, and how many blocks of
+// a chain read prefetches at a time (one I/O batch, see IO_QUEUE_DEPTH)
+const uint32_t MIN_CACHE_BLOCKS = 64;
+const uint32_t READAHEAD_BLOCKS = 32;
+
+// Optional sections stored after the block area as <tag, length, payload>.
+// Images written before a section existed simply end early, so the loader
+// rebuilds that state instead.
+const uint32_t SECTION_REFCOUNTS = 1;
+const uint32_t SECTION_SNAPSHOTS = 2;
+const uint32_t SECTION_BLOCK_GENERATIONS = 3;
+const uint32_t SECTION_ENTRY_GENERATIONS = 4; // Only in images with the legacy tree layout
+const uint32_t SECTION_CHECKSUMS = 5;
+
+// Delta streams produced by export_delta: a header, then tagged records
+const uint32_t DELTA_MAGIC = 0x4C445346; // "FSDL"
+const uint32_t DELTA_VERSION = 3;
+const uint8_t DELTA_FAT_RANGE = 1;
+const uint8_t DELTA_BLOCK_DATA = 2;
+const uint8_t DELTA_DIRECTORY = 3;
+const uint8_t DELTA_SNAPSHOTS = 4;
+const uint8_t DELTA_COUNTERS = 5; // Version 2 and later
+const uint8_t DELTA_ENTRY = 6;    // Version 3 and later
+const uint8_t DELTA_REMOVAL = 7;  // Version 3 and later
+const uint8_t DELTA_SHARED = 8;   // Version 3 and later
+const uint8_t DELTA_END = 0xFF;
+
+// Journal records wrap one delta: <magic, payload length, checksum, payload>
+const uint32_t JOURNAL_MAGIC = 0x524A5346; // "FSJR"
+
+
+// A read-only copy of the directory tree. Its files keep a reference on their
+// chains, so the blocks survive until the snapshot is deleted.
+struct Snapshot {
+    std::string name;
+    std::time_t creation_time;
+    uint32_t generation; // Last generation whose changes the snapshot contains
+    DirectoryEntry root;
 };
 
+// Delta contents as read before applying (see delta.cpp)
+struct DeltaRecords;
+struct TreeChange;
+
+// Tar stream state (see tar.cpp)
+struct TarSummary;
+class TarReader;
+class TarWriter;
+
 class FileSystem {
 
     private:
         Superblock superblock;
         std::vector<uint16_t> fat;
-        std::vector<DiskBlock> blocks;
+        mutable BufferCache blocks; // Block data, resident or cached (see buffercache.h)
+        uint32_t cache_capacity;    // Buffer cache size in blocks; 0 keeps every block resident
+        IOBackend io_backend;       // How the buffer cache batches its I/O when disk-resident
+        const BlockKernels* kernels; // Data-path kernels for superblock.block_size (see blockkernels.h)
+        std::vector<uint32_t> refcounts; // Incoming references (entries or FAT links) per block
+        std::vector<uint32_t> block_generations; // Generation of the last change to each block
+        std::vector<uint32_t> block_checksums; // CRC32C of each block's data
+        uint32_t share_epoch; // Advanced whenever a chain may become shared, invalidating cached tails
+        uint32_t shared_generation; // Generation of the last share_epoch advance
         void load_filesystem(const std::string& filename);
         DirectoryEntry root_directory;
-        void write_directory(std::ofstream& ofs, const DirectoryEntry& directory);
-        void read_directory(std::ifstream& ifs, DirectoryEntry& directory);
+        std::vector<Snapshot> snapshots;
+        DirectoryEntry* mounted_root; // Root used for path lookups; a snapshot root when mounted
+        bool read_only;
+        void write_directory(std::ostream& ofs, const DirectoryEntry& directory);
+        void read_directory(std::istream& ifs, DirectoryEntry& directory);
+        void read_legacy_directory(std::istream& ifs, DirectoryEntry& directory);
+        void write_entry(std::ostream& ofs, const DirectoryEntry& entry);
+        void read_entry(std::istream& ifs, DirectoryEntry& entry);
+        void applyEntryGenerations(DirectoryEntry& directory, const uint32_t*& generations, const uint32_t* end);
+        void markBlock(uint16_t block);
+        void updateChecksum(uint16_t block);
+        bool verifyBlock(uint16_t block) const;
+        std::string findBlockOwner(const DirectoryEntry& directory, const std::string& path, uint16_t block);
+        void touchEntry(DirectoryEntry& entry);
+        void linkEntry(DirectoryEntry& entry);
+        void unlinkEntry(DirectoryEntry& directory, const std::string& name);
+        void markShared();
+        uint32_t advanceGeneration();
+        void exportDirectory(std::ostream& os, const DirectoryEntry& directory, const std::string& path, uint32_t from_generation, bool whole_subtree);
+        void applyDirectory(TreeChange& change);
+        void applyEntry(TreeChange& change);
+        void applyRemoval(TreeChange& change);
+        void readDelta(std::istream& is, DeltaRecords& delta);
+        uint32_t writeDelta(std::ostream& os, uint32_t from_generation, uint32_t& changed_blocks);
+        bool readDeltaHeader(std::istream& is, uint32_t& from_generation, uint32_t& to_generation);
+        uint32_t applyDelta(std::istream& is);
+        uint64_t write_image(std::ostream& ofs);
+        void prefetchChain(uint16_t block, uint32_t count);
+        ChainState chainState();
+
+        // Journal state (see journal.cpp)
+        std::string image_name;
+        int journal_fd;
+        uint32_t journaled_generation; // Everything up to here is in the image or the journal
+        uint32_t removal_log_start;    // Removal logs cover every removal after this generation
+        bool modified;                 // Changes not yet appended to the journal
+        std::thread checkpoint_thread;
+        std::atomic<bool> checkpoint_done;
+        bool checkpoint_failed;
+        uint64_t checkpoint_journal_offset; // Journal bytes the running checkpoint makes obsolete
+        std::string journalPath() const;
+        void initJournal(const std::string& file_name);
+        void replayJournal();
+        void appendJournalRecord();
+        void finishCheckpoint(bool wait);
+        void compactJournal(uint64_t offset);
+        std::string serializeSnapshots();
+        void deserializeSnapshots(const std::string& payload, std::vector<Snapshot>& parsed);
+        void retainTree(const DirectoryEntry& directory);
+        void collectChains(const DirectoryEntry& directory, std::vector<uint16_t>& start_blocks);
+        void releaseTree(const DirectoryEntry& directory);
+        bool checkWritable();
+        void write_section(std::ostream& ofs, uint32_t tag, const std::string& payload);
+        void rebuildRefcounts(const DirectoryEntry& directory);
+        bool isChainBlock(uint16_t block) const;
+        void rebuildVolumeCounters();
+        void adjustDirectorySizes(const std::string& path, int64_t delta);
+        uint16_t findFreeRun(uint32_t count, uint16_t goal) const;
+        void claimBlock(uint16_t block);
+        uint16_t allocationGoal(const DirectoryEntry& directory) const;
+        void defragDirectory(DirectoryEntry& directory, uint32_t max_files, uint32_t& moved_files, uint32_t& moved_blocks, uint32_t& unplaced_files);
+        void printFragmentation(const std::string& label);
+        DirectoryEntry* findEntry(const std::string& path);
+        bool grepFile(const DirectoryEntry& entry, const std::string& path, const std::string& pattern, std::string& output, uint32_t& matches);
+        DirectoryEntry* findWritableFile(const std::string& path);
+        uint16_t privateTail(DirectoryEntry& entry);
+        bool extendChain(uint16_t tail, uint32_t count, std::vector<uint16_t>& added);
+        void cutChain(uint16_t last);
+        void fillBlock(uint16_t block, std::istream& is, uint32_t offset, uint32_t length);
+        bool tarEntry(TarWriter& writer, const DirectoryEntry& entry, const std::string& path, TarSummary& summary);
+        DirectoryEntry* tarDirectory(const std::string& path, TarSummary& summary);
+        bool tarFile(TarReader& reader, DirectoryEntry& parent, const std::string& parent_path, DirectoryEntry& file);
 
     public:
 
         FileSystem(const std::string& file_name, uint32_t total_blocks, uint32_t block_size);
-        FileSystem(const std::string& file_name);
+        FileSystem(const std::string& file_name, uint32_t cache_blocks = 0, IOBackend backend = BACKEND_PREAD);
+        ~FileSystem();
 
         void save_filesystem(const std::string& filename);
+        void commit();
+        void checkpoint(bool background);
+        uint64_t journal_size() const;
 
         void dir(const std::string& path);
         void ls_directory(const DirectoryEntry& entry);
         DirectoryEntry* findDirectory(const std::string& path);
         bool is_directory(const DirectoryEntry& entry);
-        void allocateBlocksForFile(DirectoryEntry& entry, uint32_t file_size);
+        bool allocateBlocksForFile(DirectoryEntry& entry, uint32_t file_size, uint16_t goal);
         void deallocateBlocksForFile(const DirectoryEntry& entry);
-        uint16_t findNextFreeBlock();
-        void calculateDirectorySize(DirectoryEntry& directory);
+        void releaseChain(uint16_t start_block);
+        void releaseChains(const std::vector<uint16_t>& start_blocks);
+        uint16_t unshareBlock(DirectoryEntry& entry, uint32_t block_index);
+        bool allocateBlocks(uint32_t count, uint16_t goal, std::vector<uint16_t>& allocated);
+        uint32_t calculateDirectorySize(DirectoryEntry& directory);
         void setPermissionsFromLinuxFile(DirectoryEntry& entry, const std::string& linux_file);
 
         void apply_file_metadata(const std::string& path, const DirectoryEntry& entry);
@@ -51,16 +195,38 @@ class FileSystem {
         void mkdir(const std::string& path);
         void rmdir(const std::string& path);
         void dumpe2fs();
+        void print_cache_stats();
+        void du(const std::string& path);
         uint32_t countFiles(const DirectoryEntry& directory);
         uint32_t countDirectories(const DirectoryEntry& directory);
         void listOccupiedBlocks(const DirectoryEntry& directory);
         void write(const std::string& path, const std::string& linux_file);
         void read(const std::string& path, const std::string& linux_file);
-        void del(const std::string& path);;
+        void del(const std::string& path);
+        void overwrite(const std::string& path, const std::string& linux_file);
+        void append(const std::string& path, const std::string& linux_file);
+        void fs_truncate(const std::string& path, uint32_t new_size);
+        void cp(const std::string& source_path, const std::string& destination_path);
+        void mv(const std::string& source_path, const std::string& destination_path);
         void fs_chmod(const std::string& path, const std::string& permissions);
         void addpw(const std::string& path, const std::string& password);
         bool checkPassword(const DirectoryEntry& entry);
 
+        void snapshot(const std::string& name);
+        void list_snapshots();
+        void delete_snapshot(const std::string& name);
+        bool mount_snapshot(const std::string& name);
+        void scrub(unsigned int num_threads);
+        void fsck(bool repair, unsigned int num_threads);
+        void defrag(uint32_t max_files);
+        void find(const std::string& path, const std::string& pattern, const std::string& size_filter, const std::string& mtime_filter);
+        void grep(const std::string& pattern, const std::string& path);
+
+        void export_delta(uint32_t from_generation, const std::string& delta_file);
+        bool apply_delta(const std::string& delta_file);
+        bool tar_in(const std::string& path, std::istream& is);
+        bool tar_out(const std::string& path, std::ostream& os);
+
 };
 
 #endif
\ No newline at end of file
@@ -1,77 +1,86 @@
 #include <iostream>
 #include <cstdio>
 #include <string>
+#include <vector>
 #include "filesystem.h"
+#include "commands.h"
+#include "metrics.h"
+#include "trace.h"
+#include "utility.h"
 
 int main(int argc, char* argv[]) {
-    if (argc < 3) {
-        std::cerr << "Usage: " << argv[0] << " <fileSystem.data> <operation> [parameters]" << std::endl;
+    // Leading options come before the file system name
+    std::string snapshot_name;
+    std::string metrics_file;
+    std::string trace_file;
+    uint32_t cache_blocks = 0;
+    IOBackend io_backend = BACKEND_PREAD;
+    std::vector<char*> args(argv, argv + argc);
+    bool valid = true;
+    while (args.size() > 1) {
+        std::string option = args[1];
+        if (option == "--stats") {
+            metrics_enabled = true;
+            args.erase(args.begin() + 1);
+        } else if (option == "--io-uring") {
+            io_backend = BACKEND_IO_URING;
+            args.erase(args.begin() + 1);
+        } else if (args.size() > 2 && option == "--snapshot") {
+            snapshot_name = args[2];
+            args.erase(args.begin() + 1, args.begin() + 3);
+        } else if (args.size() > 2 && option == "--cache") {
+            valid = valid && parse_number(args[2], cache_blocks);
+            args.erase(args.begin() + 1, args.begin() + 3);
+        } else if (args.size() > 2 && option == "--trace") {
+            trace_file = args[2];
+            args.erase(args.begin() + 1, args.begin() + 3);
+        } else if (args.size() > 2 && option == "--metrics") {
+            metrics_file = args[2];
+            metrics_enabled = true;
+            args.erase(args.begin() + 1, args.begin() + 3);
+        } else {
+            break;
+        }
+    }
+    argc = args.size();
+    argv = args.data();
+
+    if (argc < 3 || !valid) {
+        std::cerr << "Usage: " << argv[0] << " [--snapshot <name>] [--stats] [--metrics <file.json>] [--trace <file>] [--cache <blocks> [--io-uring]] <fileSystem.data> <operation> [parameters]" << std::endl;
         return 1;
     }
 
     std::string file_system_name = argv[1];
-    std::string operation = argv[2];
 
-    FileSystem fs(file_system_name);
+    // stats on its own reports the cost of loading this image
+    if (std::string(argv[2]) == "stats") {
+        metrics_enabled = true;
+    }
 
-    if (operation == "dir") {
-        if (argc != 4) {
-            std::cerr << "Usage: " << argv[0] << " <fileSystem.data> dir <path>" << std::endl;
-            return 1;
-        }
-        std::string path = argv[3];
-        fs.dir(argv[3]);
-    } else if (operation == "mkdir") {
-        if (argc != 4) {
-            std::cerr << "Usage: " << argv[0] << " <fileSystem.data> mkdir <path>" << std::endl;
-            return 1;
-        }
-        fs.mkdir(argv[3]);
-    } else if (operation == "rmdir") {
-        if (argc != 4) {
-            std::cerr << "Usage: " << argv[0] << " <fileSystem.data> rmdir <path>" << std::endl;
-            return 1;
-        }
-        fs.rmdir(argv[3]);
-    } else if (operation == "dumpe2fs") {
-        if (argc != 3) {
-            std::cerr << "Usage: " << argv[0] << " <fileSystem.data> dumpe2fs" << std::endl;
-            return 1;
-        }
-        fs.dumpe2fs();
-    } else if (operation == "write") {
-        if (argc != 5) {
-            std::cerr << "Usage: " << argv[0] << " <fileSystem.data> write <path> <linux_file>" << std::endl;
-            return 1;
-        }
-        fs.write(argv[3], argv[4]);
-    } else if (operation == "read") {
-        if (argc != 5) {
-            std::cerr << "Usage: " << argv[0] << " <fileSystem.data> read <path> <linux_file>" << std::endl;
-            return 1;
-        }
-        fs.read(argv[3], argv[4]);
-    } else if (operation == "del") {
-        if (argc != 4) {
-            std::cerr << "Usage: " << argv[0] << " <fileSystem.data> del <path>" << std::endl;
-            return 1;
-        }
-        fs.del(argv[3]);
-    } else if (operation == "chmod") {
-        if (argc != 5) {
-            std::cerr << "Usage: " << argv[0] << " <fileSystem.data> chmod <path> <permissions>" << std::endl;
-            return 1;
-        }
-        fs.fs_chmod(argv[3], argv[4]);
-    } else if (operation == "addpw") {
-        if (argc != 5) {
-            std::cerr << "Usage: " << argv[0] << " <fileSystem.data> addpw <path> <password>" << std::endl;
-            return 1;
-        }
-        fs.addpw(argv[3],argv[4]);
+    FileSystem fs(file_system_name, cache_blocks, io_backend);
+
+    if (!trace_file.empty() && !open_trace(trace_file)) {
+        std::cerr << "Error: Unable to open trace file: " << trace_file << std::endl;
+        return 1;
     }
 
+    // A mounted snapshot is read-only, so nothing is saved afterwards
+    if (!snapshot_name.empty() && !fs.mount_snapshot(snapshot_name)) {
+        return 1;
+    }
 
-    fs.save_filesystem(file_system_name);
+    int status = run_command(fs, argv[0], std::vector<std::string>(argv + 2, argv + argc));
+
+    // Durability costs one journal append; the image itself is rewritten by
+    // a checkpoint once the journal grows large
+    if (snapshot_name.empty()) {
+        commit_command(fs);
+    }
+
+    if (!metrics_file.empty() && !write_metrics_json(metrics_file)) {
+        std::cerr << "Error: Unable to write metrics to " << metrics_file << std::endl;
+        return 1;
+    }
 
+    return status;
 }
\ No newline at end of file
@@ -0,0 +1,288 @@
+#include "filesystem.h"
+#include "workpool.h"
+#include <iostream>
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+
+/*
+FSCK
+A block's reference count should equal the number of file entries (live or
+in a snapshot) starting at it plus the number of reachable blocks linking
+to it. fsck walks every chain to find the reachable blocks, recomputes the
+expected counts and compares them, the FAT and the entry sizes.
+*/
+
+namespace {
+
+enum ChainProblem {
+    CHAIN_OK,
+    CHAIN_DANGLING,  // Start block is out of range or free
+    CHAIN_TRUNCATED, // Chain breaks or ends before covering the file size
+    CHAIN_CYCLIC,    // Chain loops back on itself
+    CHAIN_OVERLONG   // Chain continues past the blocks the file size needs
+};
+
+struct ChainCheck {
+    DirectoryEntry* entry;
+    std::string path;
+    ChainProblem problem;
+    uint32_t length;     // Valid blocks walked
+    uint16_t last_block; // Last valid block walked
+};
+
+struct WorkItem {
+    DirectoryEntry* entry;
+    std::string path;
+};
+
+struct FsckState {
+    const std::vector<uint16_t>& fat;
+    uint32_t block_size;
+    std::vector<std::atomic<uint8_t>> reachable;
+    std::vector<std::atomic<uint32_t>> expected_refs;
+
+    FsckState(const std::vector<uint16_t>& fat, uint32_t block_size)
+        : fat(fat), block_size(block_size), reachable(fat.size()), expected_refs(fat.size()) {
+        for (size_t i = 0; i < fat.size(); ++i) {
+            reachable[i].store(0, std::memory_order_relaxed);
+            expected_refs[i].store(0, std::memory_order_relaxed);
+        }
+    }
+
+    bool valid(uint16_t block) const {
+        return block != 0 && block < fat.size();
+    }
+};
+
+// Walk one file's chain. The hop limit doubles as cycle detection: no valid
+// chain can be longer than the number of blocks.
+ChainCheck check_chain(FsckState& state, DirectoryEntry& entry, const std::string& path) {
+    ChainCheck check = {&entry, path, CHAIN_OK, 0, FAT_EOC};
+    uint32_t needed_blocks = std::max<uint32_t>(1, (entry.getSize() + state.block_size - 1) / state.block_size);
+
+    uint16_t block = entry.getStartBlock();
+    if (block == FAT_EOC && entry.getSize() == 0) {
+        // Emptied by an earlier repair; overwrite and append give it a new chain
+        return check;
+    }
+    if (!state.valid(block) || state.fat[block] == FAT_FREE) {
+        check.problem = CHAIN_DANGLING;
+        return check;
+    }
+    state.expected_refs[block].fetch_add(1, std::memory_order_relaxed);
+
+    for (;;) {
+        if (check.length >= state.fat.size()) {
+            check.problem = CHAIN_CYCLIC;
+            return check;
+        }
+        state.reachable[block].store(1, std::memory_order_relaxed);
+        check.length++;
+        check.last_block = block;
+
+        uint16_t next = state.fat[block];
+        if (next == FAT_EOC) {
+            break;
+        }
+        if (!state.valid(next) || state.fat[next] == FAT_FREE) {
+            // Dangling link, a half-built chain still marked FAT_USED, or a
+            // link into free space
+            check.problem = CHAIN_TRUNCATED;
+            return check;
+        }
+        block = next;
+    }
+
+    if (check.length < needed_blocks) {
+        check.problem = CHAIN_TRUNCATED;
+    } else if (check.length > needed_blocks) {
+        check.problem = CHAIN_OVERLONG;
+    }
+    return check;
+}
+
+const char* problem_name(ChainProblem problem) {
+    switch (problem) {
+        case CHAIN_DANGLING: return "dangling start block";
+        case CHAIN_TRUNCATED: return "truncated chain";
+        case CHAIN_CYCLIC: return "cyclic chain";
+        case CHAIN_OVERLONG: return "chain longer than file size";
+        default: return "ok";
+    }
+}
+
+}
+
+
+void FileSystem::fsck(bool repair, unsigned int num_threads) {
+    if (repair && !checkWritable()) {
+        return;
+    }
+    if (num_threads == 0) {
+        num_threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    FsckState state(fat, superblock.block_size);
+
+    // Walk the tree one entry per task, starting from the children of the
+    // live root and of every snapshot root. Each directory pushes its
+    // children, and idle threads steal them, so one large subtree is spread
+    // over every thread too.
+    std::vector<WorkItem> work;
+    for (auto& child : root_directory.children) {
+        work.push_back({&child, "/" + child.getFilename()});
+    }
+    for (Snapshot& snapshot : snapshots) {
+        for (auto& child : snapshot.root.children) {
+            work.push_back({&child, "@" + snapshot.name + "/" + child.getFilename()});
+        }
+    }
+
+    WorkStealingPool<WorkItem> pool(num_threads);
+    std::vector<std::vector<ChainCheck>> thread_results(pool.size());
+    std::vector<uint32_t> thread_directories(pool.size(), 0);
+    pool.run(work, [&](unsigned int worker, WorkItem& item) {
+        DirectoryEntry& entry = *item.entry;
+        if (entry.getAttribute() & ATTR_DIRECTORY) {
+            thread_directories[worker]++;
+            for (auto& child : entry.children) {
+                pool.push(worker, {&child, item.path + "/" + child.getFilename()});
+            }
+        } else {
+            thread_results[worker].push_back(check_chain(state, entry, item.path));
+        }
+    });
+
+    // Every reachable block holds one reference on its successor
+    std::vector<std::thread> workers;
+    size_t slice = (fat.size() + num_threads - 1) / num_threads;
+    for (unsigned int t = 0; t < num_threads; ++t) {
+        workers.push_back(std::thread([&, t]() {
+            size_t last = std::min(fat.size(), (t + 1) * slice);
+            for (size_t block = t * slice; block < last; ++block) {
+                if (state.reachable[block].load(std::memory_order_relaxed) && state.valid(fat[block]) && fat[fat[block]] != FAT_FREE) {
+                    state.expected_refs[fat[block]].fetch_add(1, std::memory_order_relaxed);
+                }
+            }
+        }));
+    }
+    for (std::thread& worker : workers) {
+        worker.join();
+    }
+
+    // Gather the findings
+    std::vector<ChainCheck> bad_chains;
+    uint32_t num_files = 0;
+    uint32_t num_directories = 1 + snapshots.size();
+    for (unsigned int t = 0; t < pool.size(); ++t) {
+        num_files += thread_results[t].size();
+        num_directories += thread_directories[t];
+        for (const ChainCheck& check : thread_results[t]) {
+            if (check.problem != CHAIN_OK) {
+                bad_chains.push_back(check);
+            }
+        }
+    }
+
+    std::vector<uint16_t> leaked;
+    std::vector<uint16_t> cross_linked;
+    std::vector<uint16_t> miscounted;
+    for (uint32_t block = 1; block < fat.size(); ++block) {
+        uint32_t expected = state.expected_refs[block].load(std::memory_order_relaxed);
+        if (fat[block] != FAT_FREE && !state.reachable[block].load(std::memory_order_relaxed)) {
+            leaked.push_back(block);
+        } else if (expected > refcounts[block]) {
+            cross_linked.push_back(block);
+        } else if (expected < refcounts[block]) {
+            miscounted.push_back(block);
+        }
+    }
+
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cout << "Checked " << num_files << " files and " << num_directories << " directories over "
+              << fat.size() << " blocks in " << seconds * 1000 << " ms using " << num_threads << " thread(s)" << std::endl;
+
+    for (const ChainCheck& check : bad_chains) {
+        std::cout << check.path << ": " << problem_name(check.problem);
+        if (check.problem != CHAIN_CYCLIC) {
+            std::cout << " (" << check.length << " blocks)";
+        }
+        std::cout << std::endl;
+    }
+    std::cout << "Leaked Blocks: " << leaked.size() << std::endl;
+    std::cout << "Cross-linked Blocks: " << cross_linked.size() << std::endl;
+    std::cout << "Over-counted Blocks: " << miscounted.size() << std::endl;
+    std::cout << "Bad Chains: " << bad_chains.size() << std::endl;
+
+    if (bad_chains.empty() && leaked.empty() && cross_linked.empty() && miscounted.empty()) {
+        std::cout << "File system is clean." << std::endl;
+        return;
+    }
+    if (!repair) {
+        return;
+    }
+
+    // Cut broken chains at their last valid block and shrink the file to
+    // what is left. Entries whose chain never started lose their data.
+    uint32_t repaired_chains = 0;
+    for (ChainCheck& check : bad_chains) {
+        DirectoryEntry& entry = *check.entry;
+        if (check.problem == CHAIN_OVERLONG) {
+            // The extra blocks are unused but still owned; nothing to cut
+            continue;
+        }
+
+        if (check.problem == CHAIN_DANGLING) {
+            entry.setStartBlock(FAT_EOC);
+            entry.setSize(0);
+        } else if (check.problem == CHAIN_CYCLIC) {
+            // Find where the loop closes and end the chain there
+            std::vector<bool> seen(fat.size(), false);
+            uint16_t block = entry.getStartBlock();
+            uint32_t length = 1;
+            seen[block] = true;
+            while (fat[block] != FAT_EOC && !seen[fat[block]]) {
+                block = fat[block];
+                seen[block] = true;
+                length++;
+            }
+            fat[block] = FAT_EOC;
+            markBlock(block);
+            entry.setSize(std::min(entry.getSize(), length * superblock.block_size));
+        } else if (check.problem == CHAIN_TRUNCATED) {
+            fat[check.last_block] = FAT_EOC;
+            markBlock(check.last_block);
+            entry.setSize(std::min(entry.getSize(), check.length * superblock.block_size));
+        }
+        touchEntry(entry);
+        repaired_chains++;
+    }
+
+    // Free what nothing reaches, then recount references from scratch, which
+    // turns accidental cross-links into copy-on-write sharing
+    for (uint16_t block : leaked) {
+        fat[block] = FAT_FREE;
+        markBlock(block);
+    }
+    std::vector<uint32_t> previous_refcounts = refcounts;
+    std::fill(refcounts.begin(), refcounts.end(), 0);
+    markShared();
+    rebuildRefcounts(root_directory);
+    for (const Snapshot& snapshot : snapshots) {
+        rebuildRefcounts(snapshot.root);
+    }
+    for (uint32_t block = 0; block < fat.size(); ++block) {
+        if (refcounts[block] != previous_refcounts[block]) {
+            markBlock(block);
+        }
+    }
+    rebuildVolumeCounters();
+
+    std::cout << "Repaired " << repaired_chains << " chains, freed " << leaked.size()
+              << " leaked blocks and recounted block references." << std::endl;
+}
@@ -0,0 +1,275 @@
+#include "filesystem.h"
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <stdexcept>
+#include <algorithm>
+#include <cstring>
+#include <cstdio>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "utility.h"
+#include "metrics.h"
+
+/*
+JOURNAL
+Instead of rewriting the image after every operation, each commit appends
+one redo record (a delta of everything changed since the previous commit)
+to <image>.journal and issues a single fdatasync. Loading replays the
+records newer than the image. A checkpoint writes a fresh image and drops
+the records it covers.
+*/
+
+namespace {
+
+const size_t RECORD_HEADER_SIZE = 3 * sizeof(uint32_t);
+
+uint32_t record_checksum(const char* data, size_t length) {
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < length; ++i) {
+        hash ^= static_cast<unsigned char>(data[i]);
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+void write_all(int fd, const char* data, size_t length) {
+    while (length > 0) {
+        ssize_t written = ::write(fd, data, length);
+        if (written < 0) {
+            throw std::runtime_error("Failed to write journal");
+        }
+        data += written;
+        length -= written;
+    }
+}
+
+// Runs on the checkpoint thread; touches nothing but its arguments
+void write_checkpoint(std::string path, std::string image, std::atomic<bool>* done, bool* failed) {
+    try {
+        std::string temp_path = path + ".tmp";
+        std::ofstream ofs(temp_path, std::ios::binary);
+        ofs.write(image.data(), image.size());
+        ofs.close();
+        if (!ofs) {
+            throw std::runtime_error("Failed to write checkpoint");
+        }
+        sync_and_rename(temp_path, path);
+    } catch (const std::exception& e) {
+        std::cerr << "Error: Checkpoint failed: " << e.what() << std::endl;
+        *failed = true;
+    }
+    *done = true;
+}
+
+}
+
+
+FileSystem::~FileSystem() {
+    finishCheckpoint(true);
+    if (journal_fd >= 0) {
+        close(journal_fd);
+    }
+}
+
+std::string FileSystem::journalPath() const {
+    return image_name + ".journal";
+}
+
+void FileSystem::initJournal(const std::string& file_name) {
+    image_name = file_name;
+    journal_fd = -1;
+    journaled_generation = 0;
+    removal_log_start = 0;
+    modified = false;
+    checkpoint_done = false;
+    checkpoint_failed = false;
+    checkpoint_journal_offset = 0;
+}
+
+uint64_t FileSystem::journal_size() const {
+    struct stat journal_stat;
+    if (stat(journalPath().c_str(), &journal_stat) != 0) {
+        return 0;
+    }
+    return journal_stat.st_size;
+}
+
+// Replay records the image does not contain yet. A record that is cut short
+// or fails its checksum marks the end of what was committed, so it and
+// anything after it are discarded.
+void FileSystem::replayJournal() {
+    std::ifstream ifs(journalPath(), std::ios::binary | std::ios::ate);
+    if (ifs.is_open()) {
+        std::string journal(static_cast<size_t>(ifs.tellg()), '\0');
+        ifs.seekg(0);
+        ifs.read(&journal[0], journal.size());
+        ifs.close();
+
+        size_t offset = 0;
+        while (offset + RECORD_HEADER_SIZE <= journal.size()) {
+            uint32_t header[3];
+            std::memcpy(header, journal.data() + offset, sizeof(header));
+            const char* payload = journal.data() + offset + RECORD_HEADER_SIZE;
+            if (header[0] != JOURNAL_MAGIC || header[1] < 6 * sizeof(uint32_t) || header[1] > journal.size() - offset - RECORD_HEADER_SIZE ||
+                record_checksum(payload, header[1]) != header[2]) {
+                break;
+            }
+
+            std::istringstream record(std::string(payload, header[1]));
+            uint32_t from_generation;
+            uint32_t to_generation;
+            std::memcpy(&to_generation, payload + 5 * sizeof(uint32_t), sizeof(to_generation));
+            if (to_generation >= superblock.generation) {
+                if (!readDeltaHeader(record, from_generation, to_generation)) {
+                    throw std::runtime_error("Journal does not belong to this image");
+                }
+                applyDelta(record);
+                uint32_t version;
+                std::memcpy(&version, payload + sizeof(uint32_t), sizeof(version));
+                if (version < 3) {
+                    share_epoch++; // Older records do not say whether chains were shared
+                }
+                superblock.generation = std::max(superblock.generation, to_generation + 1);
+            }
+            offset += RECORD_HEADER_SIZE + header[1];
+        }
+
+        if (offset < journal.size()) {
+            std::cerr << "Journal: discarded " << journal.size() - offset << " bytes of an incomplete commit." << std::endl;
+            if (truncate(journalPath().c_str(), offset) != 0) {
+                throw std::runtime_error("Failed to truncate journal");
+            }
+        }
+    }
+
+    journaled_generation = superblock.generation - 1;
+    removal_log_start = journaled_generation;
+    modified = false;
+}
+
+// Make every change so far durable with one append and one fdatasync.
+// Starts a background checkpoint once the journal outgrows half the image.
+void FileSystem::commit() {
+    if (read_only) {
+        return;
+    }
+    MetricTimer timer(HISTOGRAM_COMMIT);
+
+    finishCheckpoint(false);
+    appendJournalRecord();
+
+    uint64_t checkpoint_threshold = std::max<uint64_t>(1 << 20, static_cast<uint64_t>(superblock.total_blocks) * superblock.block_size / 2);
+    if (journal_size() > checkpoint_threshold && !checkpoint_thread.joinable()) {
+        checkpoint(true);
+    }
+}
+
+void FileSystem::appendJournalRecord() {
+    if (!modified && superblock.generation <= journaled_generation + 1) {
+        return;
+    }
+
+    std::ostringstream record;
+    uint32_t changed_blocks;
+    uint32_t to_generation = writeDelta(record, journaled_generation, changed_blocks);
+    std::string payload = record.str();
+
+    uint32_t header[3] = {JOURNAL_MAGIC, static_cast<uint32_t>(payload.size()), record_checksum(payload.data(), payload.size())};
+
+    if (journal_fd < 0) {
+        journal_fd = open(journalPath().c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+        if (journal_fd < 0) {
+            throw std::runtime_error("Failed to open journal");
+        }
+    }
+    write_all(journal_fd, reinterpret_cast<const char*>(header), sizeof(header));
+    write_all(journal_fd, payload.data(), payload.size());
+    if (fdatasync(journal_fd) != 0) {
+        throw std::runtime_error("Failed to sync journal");
+    }
+
+    journaled_generation = to_generation;
+    modified = false;
+}
+
+// Write everything into a fresh image. In the background the image is
+// serialized up front and written by another thread while operations and
+// commits continue; the records it covers are dropped once it is on disk.
+void FileSystem::checkpoint(bool background) {
+    if (read_only) {
+        return;
+    }
+
+    finishCheckpoint(true);
+    appendJournalRecord();
+
+    // The image holds everything up to the closed generation; the journal
+    // only needs what comes after it
+    journaled_generation = advanceGeneration();
+    checkpoint_journal_offset = journal_size();
+    checkpoint_done = false;
+    checkpoint_failed = false;
+
+    // A disk-resident image cannot be serialized in memory, so it is
+    // streamed to disk in the foreground
+    if (blocks.diskResident()) {
+        try {
+            save_filesystem(image_name);
+            compactJournal(checkpoint_journal_offset);
+        } catch (const std::exception& e) {
+            std::cerr << "Error: Checkpoint failed: " << e.what() << std::endl;
+        }
+        return;
+    }
+
+    std::ostringstream image;
+    write_image(image);
+
+    if (background) {
+        checkpoint_thread = std::thread(write_checkpoint, image_name, image.str(), &checkpoint_done, &checkpoint_failed);
+    } else {
+        write_checkpoint(image_name, image.str(), &checkpoint_done, &checkpoint_failed);
+        if (!checkpoint_failed) {
+            compactJournal(checkpoint_journal_offset);
+        }
+    }
+}
+
+void FileSystem::finishCheckpoint(bool wait) {
+    if (!checkpoint_thread.joinable() || (!wait && !checkpoint_done)) {
+        return;
+    }
+
+    checkpoint_thread.join();
+    if (!checkpoint_failed) {
+        compactJournal(checkpoint_journal_offset);
+    }
+}
+
+// Drop the first 'offset' bytes of the journal, keeping records appended
+// while the checkpoint was being written
+void FileSystem::compactJournal(uint64_t offset) {
+    uint64_t size = journal_size();
+    std::string tail;
+    if (size > offset) {
+        std::ifstream ifs(journalPath(), std::ios::binary);
+        ifs.seekg(offset);
+        tail.resize(size - offset);
+        ifs.read(&tail[0], tail.size());
+    }
+
+    std::string temp_path = journalPath() + ".tmp";
+    std::ofstream ofs(temp_path, std::ios::binary | std::ios::trunc);
+    ofs.write(tail.data(), tail.size());
+    ofs.close();
+    sync_and_rename(temp_path, journalPath());
+
+    if (journal_fd >= 0) {
+        close(journal_fd);
+        journal_fd = -1;
+    }
+}
@@ -4,6 +4,7 @@
 #include <string>
 #include <cstring>
 #include "filesystem.h"
+#include "utility.h"
 
 using namespace std;
 
@@ -17,19 +18,18 @@ int main(int argc, char* argv[]) {
         return 1;
     }
 
-    double block_size_kb = std::stod(argv[1]);
+    uint32_t block_size;
     std::string file_system_name = argv[2];
 
-    if (block_size_kb != 0.5 && block_size_kb != 1.0) {
+    if (!parse_block_size(argv[1], block_size)) {
         std::cerr << "Block size must be either 0.5 KB or 1 KB." << std::endl;
         return 1;
     }
 
-    uint32_t block_size = static_cast<uint32_t>(block_size_kb * 1024);
     uint32_t total_blocks;
     uint32_t max_file_system_size;
 
-    if (block_size_kb == 0.5) {
+    if (block_size == 512) {
         max_file_system_size = MAX_FILE_SYSTEM_SIZE_512;
         total_blocks = max_file_system_size / block_size;
     } else {
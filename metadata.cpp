@@ -0,0 +1,184 @@
+#include "filesystem.h"
+#include <string>
+#include <vector>
+#include <stdexcept>
+#include "metadata.h"
+#include "crc32c.h"
+
+/*
+METADATA
+The directory tree is written as fixed-width records plus a name table
+(see metadata.h) and read back with a single bulk read. Trees written in
+the older field-by-field layout are still read.
+*/
+
+namespace {
+
+// Append the entry and everything below it in preorder. Cached tails are
+// kept if they were cached in the current share epoch.
+void encode_tree(const DirectoryEntry& entry, uint32_t share_epoch, std::vector<MetadataRecord>& records, std::string& names) {
+    MetadataRecord record = MetadataRecord();
+    record.creation_time = metadata_le64(static_cast<uint64_t>(entry.getCreationTime()));
+    record.modification_time = metadata_le64(static_cast<uint64_t>(entry.getModificationTime()));
+    record.size = metadata_le32(entry.getSize());
+    record.child_count = metadata_le32(entry.children.size());
+
+    const std::string filename = entry.getFilename();
+    record.name_offset = metadata_le32(names.size());
+    record.name_length = metadata_le32(filename.size());
+    names += filename;
+    const std::string password = entry.getPassword();
+    record.password_offset = metadata_le32(password.empty() ? 0 : names.size());
+    record.password_length = metadata_le32(password.size());
+    names += password;
+
+    record.generation = metadata_le32(entry.getGeneration());
+    record.link_generation = metadata_le32(entry.getLinkGeneration());
+    record.unlink_generation = metadata_le32(entry.getUnlinkGeneration());
+    record.start_block = metadata_le16(entry.getStartBlock());
+    record.tail_block = metadata_le16(entry.getTailEpoch() == share_epoch ? entry.getTailBlock() : 0);
+    record.attribute = entry.getAttribute();
+    Permissions permissions = entry.getPermissions();
+    record.permissions = (permissions.read ? METADATA_READ : 0) | (permissions.write ? METADATA_WRITE : 0);
+    records.push_back(record);
+
+    for (const auto& child : entry.children) {
+        encode_tree(child, share_epoch, records, names);
+    }
+}
+
+struct MetadataTables {
+    const char* records;
+    uint32_t record_size;
+    uint32_t entry_count;
+    const char* names;
+    uint32_t name_table_size;
+};
+
+std::string table_string(const MetadataTables& tables, uint32_t offset, uint32_t length) {
+    if (static_cast<uint64_t>(offset) + length > tables.name_table_size) {
+        throw std::runtime_error("Metadata name out of bounds");
+    }
+    return std::string(tables.names + offset, length);
+}
+
+// Rebuild the entry at 'index' and its subtree, advancing 'index' past them.
+// Stored tails are cached in the given share epoch.
+void decode_tree(const MetadataTables& tables, uint32_t share_epoch, uint32_t& index, DirectoryEntry& entry) {
+    if (index >= tables.entry_count) {
+        throw std::runtime_error("Metadata tree is truncated");
+    }
+    const MetadataRecord& record = *reinterpret_cast<const MetadataRecord*>(tables.records + static_cast<size_t>(index) * tables.record_size);
+    index++;
+
+    entry.setFilename(table_string(tables, metadata_le32(record.name_offset), metadata_le32(record.name_length)));
+    entry.setPassword(table_string(tables, metadata_le32(record.password_offset), metadata_le32(record.password_length)));
+    entry.setCreationTime(static_cast<std::time_t>(metadata_le64(record.creation_time)));
+    entry.setModificationTime(static_cast<std::time_t>(metadata_le64(record.modification_time)));
+    entry.setSize(metadata_le32(record.size));
+    entry.setGeneration(metadata_le32(record.generation));
+    entry.setLinkGeneration(metadata_le32(record.link_generation));
+    // Version 1 records do not say when a child was last removed, so any
+    // change may have been one
+    entry.setUnlinkGeneration(tables.record_size >= sizeof(MetadataRecord) ? metadata_le32(record.unlink_generation)
+                                                                            : metadata_le32(record.generation));
+    entry.setStartBlock(metadata_le16(record.start_block));
+    entry.setTail(metadata_le16(record.tail_block), share_epoch);
+    entry.setAttribute(record.attribute);
+    entry.setPermissions({(record.permissions & METADATA_READ) != 0, (record.permissions & METADATA_WRITE) != 0});
+
+    uint32_t child_count = metadata_le32(record.child_count);
+    if (child_count > tables.entry_count - index) {
+        throw std::runtime_error("Metadata child count out of bounds");
+    }
+    entry.children.resize(child_count);
+    for (auto& child : entry.children) {
+        decode_tree(tables, share_epoch, index, child);
+    }
+}
+
+}
+
+
+void FileSystem::write_directory(std::ostream& ofs, const DirectoryEntry& directory) {
+    std::vector<MetadataRecord> records;
+    std::string names;
+    encode_tree(directory, share_epoch, records, names);
+
+    size_t records_size = records.size() * sizeof(MetadataRecord);
+    MetadataHeader header = MetadataHeader();
+    header.magic = metadata_le32(METADATA_MAGIC);
+    header.version = metadata_le32(METADATA_VERSION);
+    header.header_size = metadata_le32(sizeof(MetadataHeader));
+    header.record_size = metadata_le32(sizeof(MetadataRecord));
+    header.entry_count = metadata_le32(records.size());
+    header.name_table_size = metadata_le32(names.size());
+
+    // The checksum covers both tables, so write them from one buffer
+    std::string tables(reinterpret_cast<const char*>(records.data()), records_size);
+    tables += names;
+    header.checksum = metadata_le32(crc32c(tables.data(), tables.size()));
+
+    ofs.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    ofs.write(tables.data(), tables.size());
+}
+
+void FileSystem::read_directory(std::istream& ifs, DirectoryEntry& directory) {
+    std::streampos start = ifs.tellg();
+    MetadataHeader header;
+    if (!ifs.read(reinterpret_cast<char*>(&header.magic), sizeof(header.magic)) || metadata_le32(header.magic) != METADATA_MAGIC) {
+        ifs.clear();
+        ifs.seekg(start);
+        read_legacy_directory(ifs, directory);
+        return;
+    }
+
+    ifs.read(reinterpret_cast<char*>(&header) + sizeof(header.magic), sizeof(header) - sizeof(header.magic));
+    uint32_t header_size = metadata_le32(header.header_size);
+    uint32_t record_size = metadata_le32(header.record_size);
+    uint32_t entry_count = metadata_le32(header.entry_count);
+    uint32_t name_table_size = metadata_le32(header.name_table_size);
+    uint32_t version = metadata_le32(header.version);
+    if (!ifs || version == 0 || version > METADATA_VERSION || header_size < sizeof(MetadataHeader) ||
+        record_size < (version == 1 ? METADATA_V1_RECORD_SIZE : sizeof(MetadataRecord)) || record_size % 8 != 0 || entry_count == 0) {
+        throw std::runtime_error("Unsupported or corrupt metadata header");
+    }
+    ifs.seekg(header_size - sizeof(MetadataHeader), std::ios::cur);
+
+    // Records and names in one read, into 8-byte aligned storage
+    uint64_t records_size = static_cast<uint64_t>(entry_count) * record_size;
+    uint64_t total_size = records_size + name_table_size;
+    if (total_size > (1ull << 32)) {
+        throw std::runtime_error("Metadata tables are too large");
+    }
+    std::vector<uint64_t> buffer((total_size + 7) / 8);
+    char* data = reinterpret_cast<char*>(buffer.data());
+    if (!ifs.read(data, total_size)) {
+        throw std::runtime_error("Metadata tables are truncated");
+    }
+    if (crc32c(data, total_size) != metadata_le32(header.checksum)) {
+        throw std::runtime_error("Metadata checksum mismatch");
+    }
+
+    MetadataTables tables = {data, record_size, entry_count, data + records_size, name_table_size};
+    uint32_t index = 0;
+    decode_tree(tables, share_epoch, index, directory);
+    if (index != entry_count) {
+        throw std::runtime_error("Metadata holds entries outside the tree");
+    }
+}
+
+// The field-by-field layout written before METADATA_VERSION 1
+void FileSystem::read_legacy_directory(std::istream& ifs, DirectoryEntry& directory) {
+    read_entry(ifs, directory);
+
+    // Load the number of children
+    uint32_t num_children;
+    ifs.read(reinterpret_cast<char*>(&num_children), sizeof(num_children));
+
+    // Recursively load each child
+    directory.children.resize(num_children);
+    for (auto& child : directory.children) {
+        read_legacy_directory(ifs, child);
+    }
+}
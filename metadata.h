@@ -0,0 +1,80 @@
+#ifndef METADATA_H
+#define METADATA_H
+
+#include <cstdint>
+
+// Directory tree as stored in the image: a header, one fixed-width record
+// per entry in preorder (root first, each directory followed by its
+// children), then a table holding every name and password back to back.
+// All fields are little-endian and records are 8-byte aligned relative to
+// the header, so the tree can be loaded with one bulk read or walked in
+// place from a mapping. Images written before this format start the tree
+// with the root's name length instead of METADATA_MAGIC.
+const uint32_t METADATA_MAGIC = 0x544D5346; // "FSMT"
+const uint32_t METADATA_VERSION = 2;
+const uint32_t METADATA_V1_RECORD_SIZE = 56; // Records end after the first 'reserved'
+
+// Record permission bits
+const uint8_t METADATA_READ = 0x01;
+const uint8_t METADATA_WRITE = 0x02;
+
+struct MetadataHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t header_size;     // Bytes from the magic to the first record
+    uint32_t record_size;     // Bytes per record; later versions may append fields
+    uint32_t entry_count;
+    uint32_t name_table_size; // Bytes of the name table after the records
+    uint32_t checksum;        // CRC32C of the records and the name table
+    uint32_t reserved;
+};
+
+struct MetadataRecord {
+    int64_t creation_time;
+    int64_t modification_time;
+    uint32_t size;
+    uint32_t child_count;
+    uint32_t name_offset;     // Into the name table
+    uint32_t name_length;
+    uint32_t password_offset; // Into the name table
+    uint32_t password_length;
+    uint32_t generation;
+    uint32_t link_generation;
+    uint16_t start_block;
+    uint8_t attribute;
+    uint8_t permissions;      // METADATA_READ | METADATA_WRITE
+    uint16_t tail_block;      // Last block of a private chain, or 0 if unknown
+    uint16_t reserved;
+    uint32_t unlink_generation; // Version 2 and later
+    uint32_t padding;
+};
+
+static_assert(sizeof(MetadataHeader) == 32, "MetadataHeader layout changed");
+static_assert(sizeof(MetadataRecord) == 64, "MetadataRecord layout changed");
+
+// Convert between host order and the little-endian order stored on disk
+inline uint16_t metadata_le16(uint16_t value) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    return __builtin_bswap16(value);
+#else
+    return value;
+#endif
+}
+
+inline uint32_t metadata_le32(uint32_t value) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    return __builtin_bswap32(value);
+#else
+    return value;
+#endif
+}
+
+inline uint64_t metadata_le64(uint64_t value) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    return __builtin_bswap64(value);
+#else
+    return value;
+#endif
+}
+
+#endif
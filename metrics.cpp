@@ -0,0 +1,140 @@
+#include "metrics.h"
+#include <fstream>
+#include <iomanip>
+
+bool metrics_enabled = false;
+std::atomic<uint64_t> metric_counters[COUNTER_COUNT];
+Histogram metric_histograms[HISTOGRAM_COUNT];
+
+namespace {
+
+const char* const counter_names[COUNTER_COUNT] = {
+    "blocks_allocated",
+    "blocks_freed",
+    "blocks_copied",
+    "fat_hops",
+    "bytes_read",
+    "bytes_written",
+    "lookups",
+    "entries_scanned"
+};
+
+const char* const counter_labels[COUNTER_COUNT] = {
+    "Blocks Allocated",
+    "Blocks Freed",
+    "Blocks Copied",
+    "FAT Hops",
+    "Bytes Read",
+    "Bytes Written",
+    "Directory Lookups",
+    "Entries Scanned"
+};
+
+const char* const histogram_names[HISTOGRAM_COUNT] = {
+    "load",
+    "save",
+    "commit",
+    "lookup",
+    "allocate"
+};
+
+const char* const histogram_labels[HISTOGRAM_COUNT] = {
+    "Load",
+    "Save",
+    "Commit",
+    "Lookup",
+    "Allocate"
+};
+
+// Upper bound in microseconds of the bucket holding the given percentile
+uint64_t bucket_percentile(const Histogram& histogram, double p) {
+    uint64_t count = histogram.count.load(std::memory_order_relaxed);
+    uint64_t seen = 0;
+    for (int i = 0; i < HISTOGRAM_BUCKETS; ++i) {
+        seen += histogram.buckets[i].load(std::memory_order_relaxed);
+        if (seen > 0 && seen >= p * count) {
+            return 1ull << i;
+        }
+    }
+    return 1ull << (HISTOGRAM_BUCKETS - 1);
+}
+
+}
+
+
+void record_latency(MetricHistogram histogram, uint64_t nanoseconds) {
+    Histogram& target = metric_histograms[histogram];
+    uint64_t microseconds = nanoseconds / 1000;
+    int bucket = 0;
+    while (microseconds > 0 && bucket < HISTOGRAM_BUCKETS - 1) {
+        microseconds >>= 1;
+        bucket++;
+    }
+
+    target.buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+    target.count.fetch_add(1, std::memory_order_relaxed);
+    target.total_ns.fetch_add(nanoseconds, std::memory_order_relaxed);
+    uint64_t previous_max = target.max_ns.load(std::memory_order_relaxed);
+    while (nanoseconds > previous_max && !target.max_ns.compare_exchange_weak(previous_max, nanoseconds, std::memory_order_relaxed)) {
+    }
+}
+
+void print_metrics(std::ostream& os) {
+    if (!metrics_enabled) {
+        os << "Metrics are disabled; pass --stats or --metrics <file> before the file system name." << std::endl;
+        return;
+    }
+
+    for (int i = 0; i < COUNTER_COUNT; ++i) {
+        os << counter_labels[i] << ": " << metric_counters[i].load(std::memory_order_relaxed) << std::endl;
+    }
+
+    os << std::left << std::setw(10) << "Latency" << std::right
+       << std::setw(10) << "Count"
+       << std::setw(14) << "Total ms"
+       << std::setw(12) << "Mean us"
+       << std::setw(12) << "p50 <= us"
+       << std::setw(12) << "p99 <= us"
+       << std::setw(12) << "Max us" << std::endl;
+    for (int i = 0; i < HISTOGRAM_COUNT; ++i) {
+        const Histogram& histogram = metric_histograms[i];
+        uint64_t count = histogram.count.load(std::memory_order_relaxed);
+        double total_us = histogram.total_ns.load(std::memory_order_relaxed) / 1000.0;
+        os << std::left << std::setw(10) << histogram_labels[i] << std::right
+           << std::setw(10) << count
+           << std::fixed << std::setprecision(3)
+           << std::setw(14) << total_us / 1000
+           << std::setprecision(1)
+           << std::setw(12) << (count > 0 ? total_us / count : 0)
+           << std::setw(12) << (count > 0 ? bucket_percentile(histogram, 0.50) : 0)
+           << std::setw(12) << (count > 0 ? bucket_percentile(histogram, 0.99) : 0)
+           << std::setw(12) << histogram.max_ns.load(std::memory_order_relaxed) / 1000.0 << std::endl;
+    }
+}
+
+bool write_metrics_json(const std::string& file_name) {
+    std::ofstream ofs(file_name);
+    if (!ofs.is_open()) {
+        return false;
+    }
+
+    ofs << "{" << std::endl << "  \"counters\": {";
+    for (int i = 0; i < COUNTER_COUNT; ++i) {
+        ofs << (i > 0 ? ", " : "") << "\"" << counter_names[i] << "\": " << metric_counters[i].load(std::memory_order_relaxed);
+    }
+    ofs << "}," << std::endl << "  \"histograms\": {" << std::endl;
+    for (int i = 0; i < HISTOGRAM_COUNT; ++i) {
+        const Histogram& histogram = metric_histograms[i];
+        ofs << "    \"" << histogram_names[i] << "\": {"
+            << "\"count\": " << histogram.count.load(std::memory_order_relaxed)
+            << ", \"total_ns\": " << histogram.total_ns.load(std::memory_order_relaxed)
+            << ", \"max_ns\": " << histogram.max_ns.load(std::memory_order_relaxed)
+            << ", \"buckets_us\": [";
+        for (int b = 0; b < HISTOGRAM_BUCKETS; ++b) {
+            ofs << (b > 0 ? ", " : "") << histogram.buckets[b].load(std::memory_order_relaxed);
+        }
+        ofs << "]}" << (i + 1 < HISTOGRAM_COUNT ? "," : "") << std::endl;
+    }
+    ofs << "  }" << std::endl << "}" << std::endl;
+    return static_cast<bool>(ofs);
+}
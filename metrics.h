@@ -0,0 +1,80 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <ostream>
+#include <string>
+
+// Operation counters and latency histograms. Collection is off unless
+// metrics_enabled is set, in which case every update is one relaxed atomic
+// add; when it is off, each hook costs a single branch.
+
+enum MetricCounter {
+    COUNTER_BLOCKS_ALLOCATED,
+    COUNTER_BLOCKS_FREED,
+    COUNTER_BLOCKS_COPIED,   // Copy-on-write copies made by unshareBlock
+    COUNTER_FAT_HOPS,        // FAT links followed while walking chains
+    COUNTER_BYTES_READ,
+    COUNTER_BYTES_WRITTEN,
+    COUNTER_LOOKUPS,         // findDirectory calls
+    COUNTER_ENTRIES_SCANNED, // Directory entries compared during lookups
+    COUNTER_COUNT
+};
+
+enum MetricHistogram {
+    HISTOGRAM_LOAD,
+    HISTOGRAM_SAVE,
+    HISTOGRAM_COMMIT,
+    HISTOGRAM_LOOKUP,
+    HISTOGRAM_ALLOCATE,
+    HISTOGRAM_COUNT
+};
+
+// Bucket 0 holds latencies under 1 us; bucket i holds [2^(i-1), 2^i) us
+const int HISTOGRAM_BUCKETS = 32;
+
+struct Histogram {
+    std::atomic<uint64_t> buckets[HISTOGRAM_BUCKETS];
+    std::atomic<uint64_t> count;
+    std::atomic<uint64_t> total_ns;
+    std::atomic<uint64_t> max_ns;
+};
+
+extern bool metrics_enabled;
+extern std::atomic<uint64_t> metric_counters[COUNTER_COUNT];
+extern Histogram metric_histograms[HISTOGRAM_COUNT];
+
+inline void count_metric(MetricCounter counter, uint64_t amount = 1) {
+    if (metrics_enabled) {
+        metric_counters[counter].fetch_add(amount, std::memory_order_relaxed);
+    }
+}
+
+void record_latency(MetricHistogram histogram, uint64_t nanoseconds);
+
+// Records the time from construction to destruction into a histogram
+class MetricTimer {
+    public:
+        explicit MetricTimer(MetricHistogram histogram) : histogram(histogram), running(metrics_enabled) {
+            if (running) {
+                start = std::chrono::steady_clock::now();
+            }
+        }
+        ~MetricTimer() {
+            if (running) {
+                record_latency(histogram, std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+            }
+        }
+
+    private:
+        MetricHistogram histogram;
+        bool running;
+        std::chrono::steady_clock::time_point start;
+};
+
+void print_metrics(std::ostream& os);
+bool write_metrics_json(const std::string& file_name);
+
+#endif
@@ -0,0 +1,213 @@
+#include <iostream>
+#include <fstream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <map>
+#include <chrono>
+#include <thread>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "filesystem.h"
+#include "commands.h"
+#include "trace.h"
+#include "utility.h"
+
+/*
+TRACE REPLAY
+Re-executes a trace recorded with fileSystemOper --trace against a fresh
+image, either as fast as possible or at the pacing of the original run. An
+existing image named on the command line is only recreated with --overwrite.
+Host files are synthesized: write gets a scratch file of the recorded size,
+read writes to a scratch file and tar-out streams into one. addpw,
+apply-delta and tar-in are skipped, since the trace holds no passwords,
+delta files or archives.
+*/
+
+namespace {
+
+struct OperationStats {
+    std::vector<double> latencies; // Replayed seconds per operation
+    std::vector<double> original;  // Recorded seconds per operation
+    uint64_t bytes = 0;
+};
+
+double percentile(std::vector<double> values, double p) {
+    if (values.empty()) {
+        return 0;
+    }
+    std::sort(values.begin(), values.end());
+    return values[std::min(values.size() - 1, static_cast<size_t>(p * values.size()))];
+}
+
+}
+
+
+int main(int argc, char* argv[]) {
+    bool paced = false;
+    bool overwrite = false;
+    bool valid = true;
+    uint32_t block_size = 1024;
+    std::vector<std::string> positional;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--paced") {
+            paced = true;
+        } else if (arg == "--overwrite") {
+            overwrite = true;
+        } else if (arg == "--block-size" && i + 1 < argc) {
+            valid = valid && parse_block_size(argv[++i], block_size);
+        } else {
+            positional.push_back(arg);
+        }
+    }
+
+    if (!valid || positional.empty() || positional.size() > 2) {
+        std::cerr << "Usage: " << argv[0] << " [--paced] [--overwrite] [--block-size 0.5|1] <trace_file> [fileSystem.data]" << std::endl;
+        return 1;
+    }
+
+    std::ifstream trace(positional[0], std::ios::binary);
+    if (!trace.is_open() || !read_trace_header(trace)) {
+        std::cerr << "Error: Not a trace file: " << positional[0] << std::endl;
+        return 1;
+    }
+
+    struct stat image_stat;
+    if (positional.size() == 2 && !overwrite && stat(positional[1].c_str(), &image_stat) == 0) {
+        std::cerr << "Error: " << positional[1] << " already exists; pass --overwrite to replace it." << std::endl;
+        return 1;
+    }
+
+    char scratch_template[] = "/tmp/fsreplayXXXXXX";
+    if (mkdtemp(scratch_template) == nullptr) {
+        std::cerr << "Error: Unable to create a scratch directory." << std::endl;
+        return 1;
+    }
+    std::string scratch_directory = scratch_template;
+    std::string image = positional.size() == 2 ? positional[1] : scratch_directory + "/replay.data";
+    std::string read_file = scratch_directory + "/read";
+    std::string delta_file = scratch_directory + "/delta";
+    std::string tar_file = scratch_directory + "/tar";
+
+    uint32_t total_blocks = (block_size == 512 ? MAX_FILE_SYSTEM_SIZE_512 : MAX_FILE_SYSTEM_SIZE_1024) / block_size;
+
+    std::map<std::string, OperationStats> stats;
+    std::map<uint64_t, std::string> host_files;
+    uint32_t replayed = 0;
+    uint32_t skipped = 0;
+    std::chrono::steady_clock::time_point replay_start;
+    {
+        FileSystem fs(image, total_blocks, block_size);
+
+        std::ofstream null_stream("/dev/null");
+        std::streambuf* saved = std::cout.rdbuf(null_stream.rdbuf());
+        replay_start = std::chrono::steady_clock::now();
+        uint64_t trace_start = 0;
+
+        TraceRecord record;
+        while (read_trace_record(trace, record)) {
+            if (record.args.empty()) {
+                continue;
+            }
+            std::vector<std::string>& args = record.args;
+            if (args[0] == "addpw" || args[0] == "apply-delta" || args[0] == "tar-in") {
+                skipped++;
+                continue;
+            }
+
+            // Point host file arguments at scratch files
+            if ((args[0] == "write" || args[0] == "overwrite" || args[0] == "append") && args.size() == 3) {
+                std::string& host_file = host_files[record.data_size];
+                if (host_file.empty()) {
+                    host_file = scratch_directory + "/write_" + std::to_string(record.data_size);
+                    std::ofstream ofs(host_file, std::ios::binary);
+                    std::vector<char> data(record.data_size, 'x');
+                    ofs.write(data.data(), data.size());
+                }
+                args[2] = host_file;
+            } else if (args[0] == "read" && args.size() == 3) {
+                args[2] = read_file;
+            } else if (args[0] == "export-delta" && args.size() == 3) {
+                args[2] = delta_file;
+            }
+
+            if (trace_start == 0) {
+                trace_start = record.start_ns;
+            }
+            if (paced && record.start_ns > trace_start) {
+                std::this_thread::sleep_until(replay_start + std::chrono::nanoseconds(record.start_ns - trace_start));
+            }
+
+            std::chrono::steady_clock::time_point op_start = std::chrono::steady_clock::now();
+            if (args[0] == "commit") {
+                fs.commit();
+            } else if (args[0] == "tar-out" && args.size() == 2) {
+                std::ofstream tar_stream(tar_file, std::ios::binary | std::ios::trunc);
+                fs.tar_out(args[1], tar_stream);
+            } else {
+                run_command(fs, argv[0], args);
+            }
+            double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - op_start).count();
+
+            OperationStats& op_stats = stats[args[0]];
+            op_stats.latencies.push_back(seconds);
+            op_stats.original.push_back(record.duration_ns / 1e9);
+            op_stats.bytes += record.data_size;
+            replayed++;
+        }
+        fs.commit();
+        std::cout.rdbuf(saved);
+    }
+    double total_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - replay_start).count();
+
+    std::cout << "Replayed " << replayed << " operations (" << skipped << " skipped) in "
+              << std::fixed << std::setprecision(3) << total_seconds << " s, "
+              << std::setprecision(0) << replayed / total_seconds << " ops/sec"
+              << (paced ? " at the original pacing" : "") << std::endl;
+
+    std::cout << std::left << std::setw(14) << "Operation" << std::right
+              << std::setw(8) << "Count"
+              << std::setw(11) << "p50 us"
+              << std::setw(11) << "p90 us"
+              << std::setw(11) << "p99 us"
+              << std::setw(11) << "max us"
+              << std::setw(14) << "orig p50 us"
+              << std::setw(10) << "MB/sec" << std::endl;
+    for (auto& entry : stats) {
+        OperationStats& op_stats = entry.second;
+        double busy = 0;
+        for (double latency : op_stats.latencies) {
+            busy += latency;
+        }
+        std::cout << std::left << std::setw(14) << entry.first << std::right
+                  << std::setw(8) << op_stats.latencies.size()
+                  << std::setprecision(1)
+                  << std::setw(11) << percentile(op_stats.latencies, 0.50) * 1e6
+                  << std::setw(11) << percentile(op_stats.latencies, 0.90) * 1e6
+                  << std::setw(11) << percentile(op_stats.latencies, 0.99) * 1e6
+                  << std::setw(11) << percentile(op_stats.latencies, 1.0) * 1e6
+                  << std::setw(14) << percentile(op_stats.original, 0.50) * 1e6;
+        if (op_stats.bytes > 0 && busy > 0) {
+            std::cout << std::setw(10) << op_stats.bytes / busy / (1024 * 1024);
+        }
+        std::cout << std::endl;
+    }
+
+    // Clean up the scratch files; an image named on the command line is kept
+    for (auto& entry : host_files) {
+        std::remove(entry.second.c_str());
+    }
+    std::remove(read_file.c_str());
+    std::remove(delta_file.c_str());
+    std::remove(tar_file.c_str());
+    if (positional.size() == 1) {
+        std::remove(image.c_str());
+        std::remove((image + ".journal").c_str());
+    }
+    rmdir(scratch_directory.c_str());
+    return 0;
+}
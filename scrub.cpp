@@ -0,0 +1,103 @@
+#include "filesystem.h"
+#include <iostream>
+#include <string>
+#include <vector>
+#include <thread>
+#include <chrono>
+#include <algorithm>
+#include "crc32c.h"
+
+/*
+SCRUB
+*/
+
+void FileSystem::scrub(unsigned int num_threads) {
+    if (num_threads == 0) {
+        num_threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    // Only blocks in use carry data worth checking
+    std::vector<uint16_t> allocated;
+    for (uint32_t i = 1; i < fat.size(); ++i) {
+        if (fat[i] != FAT_FREE) {
+            allocated.push_back(i);
+        }
+    }
+    num_threads = std::min<unsigned int>(num_threads, std::max<size_t>(1, allocated.size()));
+
+    // Each thread verifies one contiguous slice and keeps its own bad list.
+    // When disk-resident, a slice is read in windows of one readahead batch,
+    // small enough that the threads' windows fit in the cache together.
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    std::vector<std::vector<uint16_t>> bad_blocks(num_threads);
+    std::vector<std::thread> workers;
+    size_t slice = (allocated.size() + num_threads - 1) / num_threads;
+    size_t window = blocks.diskResident()
+        ? std::max<size_t>(1, std::min<size_t>(READAHEAD_BLOCKS, blocks.capacity() / (2 * num_threads)))
+        : std::max<size_t>(1, slice);
+    for (unsigned int t = 0; t < num_threads; ++t) {
+        size_t first = t * slice;
+        size_t last = std::min(allocated.size(), first + slice);
+        workers.push_back(std::thread([this, &allocated, &bad_blocks, t, first, last, window]() {
+            for (size_t begin = first; begin < last; begin += window) {
+                size_t end = std::min(last, begin + window);
+                blocks.readahead(std::vector<uint16_t>(allocated.begin() + begin, allocated.begin() + end));
+                for (size_t i = begin; i < end; ++i) {
+                    if (!verifyBlock(allocated[i])) {
+                        bad_blocks[t].push_back(allocated[i]);
+                    }
+                }
+            }
+        }));
+    }
+    for (std::thread& worker : workers) {
+        worker.join();
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    double megabytes = static_cast<double>(allocated.size()) * superblock.block_size / (1024 * 1024);
+    std::cout << "Scrubbed " << allocated.size() << " blocks (" << megabytes << " MB) in "
+              << seconds * 1000 << " ms using " << num_threads << " thread(s), "
+              << (seconds > 0 ? megabytes / seconds : 0) << " MB/s" << std::endl;
+    std::cout << "CRC32C: " << (crc32c_hardware_accelerated() ? "SSE4.2" : "portable") << std::endl;
+
+    uint32_t num_bad = 0;
+    for (const auto& thread_bad : bad_blocks) {
+        num_bad += thread_bad.size();
+    }
+    std::cout << "Bad Blocks: " << num_bad << std::endl;
+
+    for (const auto& thread_bad : bad_blocks) {
+        for (uint16_t block : thread_bad) {
+            std::string owner = findBlockOwner(root_directory, "", block);
+            for (size_t i = 0; owner.empty() && i < snapshots.size(); ++i) {
+                owner = findBlockOwner(snapshots[i].root, "@" + snapshots[i].name, block);
+            }
+            std::cout << "Block: " << block << ", Filename: " << (owner.empty() ? "(unowned)" : owner) << std::endl;
+        }
+    }
+}
+
+// Path of the first file whose chain contains the block, or "" if none does
+std::string FileSystem::findBlockOwner(const DirectoryEntry& directory, const std::string& path, uint16_t block) {
+    for (const auto& entry : directory.children) {
+        std::string entry_path = path + "/" + entry.getFilename();
+        if (is_directory(entry)) {
+            std::string owner = findBlockOwner(entry, entry_path, block);
+            if (!owner.empty()) {
+                return owner;
+            }
+            continue;
+        }
+
+        // Bound the walk so a corrupted, cyclic chain cannot hang the scrub
+        uint16_t current = entry.getStartBlock();
+        for (size_t hops = 0; isChainBlock(current) && hops < fat.size(); ++hops) {
+            if (current == block) {
+                return entry_path;
+            }
+            current = fat[current];
+        }
+    }
+    return "";
+}
@@ -0,0 +1,337 @@
+#include "filesystem.h"
+#include <iostream>
+#include <string>
+#include <vector>
+#include <mutex>
+#include <chrono>
+#include <algorithm>
+#include <cstring>
+#include <ctime>
+#include <fnmatch.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "workpool.h"
+
+/*
+SEARCH
+find and grep walk a subtree on a work-stealing pool (see workpool.h). A
+directory task queues its children, so idle threads steal whole subtrees.
+grep scans each file's block chain through the block cache, carrying the
+unfinished line from one block to the next. Results collect in per-thread
+buffers that are written to std::cout in large pieces.
+*/
+
+namespace {
+
+struct SearchTask {
+    const DirectoryEntry* entry;
+    std::string path;
+};
+
+const size_t OUTPUT_FLUSH_BYTES = 64 * 1024;
+
+// Write a thread's buffered results once they are large enough, or always
+// when 'force' is set
+void flush_output(std::string& output, std::mutex& output_mutex, bool force) {
+    if (output.empty() || (!force && output.size() < OUTPUT_FLUSH_BYTES)) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(output_mutex);
+    std::cout.write(output.data(), output.size());
+    output.clear();
+}
+
+// A find filter such as "+100", "-7" or "3": more than, less than or equal to
+struct Filter {
+    bool active = false;
+    int sign = 0;
+    int64_t value = 0;
+
+    bool matches(int64_t actual) const {
+        return !active || (sign > 0 ? actual > value : sign < 0 ? actual < value : actual == value);
+    }
+};
+
+// Parse a filter; 'units' allows a k or M suffix (for sizes)
+bool parse_filter(const std::string& text, bool units, Filter& filter) {
+    if (text.empty()) {
+        return true;
+    }
+    size_t position = 0;
+    filter.sign = text[0] == '+' ? 1 : text[0] == '-' ? -1 : 0;
+    if (filter.sign != 0) {
+        position = 1;
+    }
+
+    size_t digits = 0;
+    try {
+        filter.value = std::stoll(text.substr(position), &digits);
+    } catch (const std::exception&) {
+        return false;
+    }
+    std::string suffix = text.substr(position + digits);
+    if (units && suffix == "k") {
+        filter.value *= 1024;
+    } else if (units && suffix == "M") {
+        filter.value *= 1024 * 1024;
+    } else if (!suffix.empty() || filter.value < 0) {
+        return false;
+    }
+    filter.active = true;
+    return true;
+}
+
+// Offset of the first occurrence of the pattern in [data, data + length),
+// or length if there is none. With SSE2, 16 candidate positions are tested
+// at once against the pattern's first and last bytes and only positions
+// matching both are compared in full.
+size_t find_substring(const char* data, size_t length, const std::string& pattern) {
+    size_t m = pattern.size();
+    if (length < m) {
+        return length;
+    }
+    size_t i = 0;
+#ifdef __SSE2__
+    const __m128i first = _mm_set1_epi8(pattern[0]);
+    const __m128i last = _mm_set1_epi8(pattern[m - 1]);
+    for (; i + m - 1 + 16 <= length; i += 16) {
+        __m128i block_first = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+        __m128i block_last = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i + m - 1));
+        unsigned int mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(first, block_first), _mm_cmpeq_epi8(last, block_last)));
+        while (mask != 0) {
+            unsigned int bit = __builtin_ctz(mask);
+            if (std::memcmp(data + i + bit, pattern.data(), m) == 0) {
+                return i + bit;
+            }
+            mask &= mask - 1;
+        }
+    }
+#endif
+    for (; i + m <= length; ++i) {
+        const void* candidate = std::memchr(data + i, pattern[0], length - m + 1 - i);
+        if (candidate == nullptr) {
+            break;
+        }
+        i = static_cast<const char*>(candidate) - data;
+        if (std::memcmp(data + i, pattern.data(), m) == 0) {
+            return i;
+        }
+    }
+    return length;
+}
+
+// Report every line of [data, data + length) holding the pattern as
+// "path:line:text". The range holds whole lines only; 'line_number' is the
+// number of its first line and is advanced past the range.
+uint32_t scan_lines(const char* data, size_t length, const std::string& pattern, const std::string& path, uint64_t& line_number, std::string& output) {
+    uint32_t matches = 0;
+    size_t position = 0;
+    while (position < length) {
+        size_t hit = position + find_substring(data + position, length - position, pattern);
+        if (hit >= length) {
+            break;
+        }
+        size_t line_start = hit;
+        while (line_start > position && data[line_start - 1] != '\n') {
+            line_start--;
+        }
+        line_number += std::count(data + position, data + line_start, '\n');
+        const void* newline = std::memchr(data + hit, '\n', length - hit);
+        size_t line_end = newline != nullptr ? static_cast<const char*>(newline) - data : length;
+
+        output += path;
+        output += ':';
+        output += std::to_string(line_number);
+        output += ':';
+        output.append(data + line_start, line_end - line_start);
+        output += '\n';
+        matches++;
+
+        position = line_end + 1;
+        line_number++;
+    }
+    if (position < length) {
+        line_number += std::count(data + position, data + length, '\n');
+    }
+    return matches;
+}
+
+}
+
+
+void FileSystem::find(const std::string& path, const std::string& pattern, const std::string& size_filter, const std::string& mtime_filter) {
+    Filter size;
+    Filter age;
+    if (!parse_filter(size_filter, true, size) || !parse_filter(mtime_filter, false, age)) {
+        std::cerr << "Error: Filters take the form [+|-]N (sizes may end in k or M)." << std::endl;
+        return;
+    }
+
+    DirectoryEntry* start = findDirectory(path);
+    if (start == nullptr) {
+        std::cerr << "Error: Directory not found: " << path << std::endl;
+        return;
+    }
+
+    std::string prefix = path == "/" ? "" : path;
+    std::vector<SearchTask> initial;
+    for (const auto& child : start->children) {
+        initial.push_back({&child, prefix + "/" + child.getFilename()});
+    }
+
+    std::time_t now = std::time(nullptr);
+    WorkStealingPool<SearchTask> pool(std::thread::hardware_concurrency());
+    std::vector<std::string> outputs(pool.size());
+    std::vector<uint32_t> found(pool.size(), 0);
+    std::mutex output_mutex;
+    pool.run(initial, [&](unsigned int worker, SearchTask& task) {
+        const DirectoryEntry& entry = *task.entry;
+        int64_t days = (now - entry.getModificationTime()) / (24 * 60 * 60);
+        if (fnmatch(pattern.c_str(), entry.getFilename().c_str(), 0) == 0 && size.matches(entry.getSize()) && age.matches(days)) {
+            outputs[worker] += task.path;
+            outputs[worker] += '\n';
+            found[worker]++;
+            flush_output(outputs[worker], output_mutex, false);
+        }
+        if (entry.getAttribute() & ATTR_DIRECTORY) {
+            for (const auto& child : entry.children) {
+                pool.push(worker, {&child, task.path + "/" + child.getFilename()});
+            }
+        }
+    });
+
+    uint32_t total = 0;
+    for (unsigned int w = 0; w < pool.size(); ++w) {
+        flush_output(outputs[w], output_mutex, true);
+        total += found[w];
+    }
+    std::cout << "Found " << total << " entries." << std::endl;
+}
+
+void FileSystem::grep(const std::string& pattern, const std::string& path) {
+    if (pattern.empty()) {
+        std::cerr << "Error: Empty search pattern." << std::endl;
+        return;
+    }
+    DirectoryEntry* start = findEntry(path);
+    if (start == nullptr) {
+        std::cerr << "Error: Path not found: " << path << std::endl;
+        return;
+    }
+
+    std::chrono::steady_clock::time_point start_time = std::chrono::steady_clock::now();
+    WorkStealingPool<SearchTask> pool(std::thread::hardware_concurrency());
+    std::vector<std::string> outputs(pool.size());
+    std::vector<uint32_t> matches(pool.size(), 0);
+    std::vector<uint32_t> matched_files(pool.size(), 0);
+    std::vector<uint32_t> skipped(pool.size(), 0);
+    std::vector<uint64_t> scanned(pool.size(), 0);
+    std::mutex output_mutex;
+    pool.run(std::vector<SearchTask>(1, {start, path}), [&](unsigned int worker, SearchTask& task) {
+        const DirectoryEntry& entry = *task.entry;
+        if (entry.getAttribute() & ATTR_DIRECTORY) {
+            std::string prefix = task.path == "/" ? "" : task.path;
+            for (const auto& child : entry.children) {
+                pool.push(worker, {&child, prefix + "/" + child.getFilename()});
+            }
+            return;
+        }
+        // Protected files would need a password prompt
+        if (!entry.getPassword().empty() || !entry.getPermissions().read) {
+            skipped[worker]++;
+            return;
+        }
+
+        uint32_t file_matches;
+        if (!grepFile(entry, task.path, pattern, outputs[worker], file_matches)) {
+            skipped[worker]++;
+            return;
+        }
+        matches[worker] += file_matches;
+        matched_files[worker] += file_matches > 0;
+        scanned[worker] += entry.getSize();
+        flush_output(outputs[worker], output_mutex, false);
+    });
+
+    uint32_t total_matches = 0;
+    uint32_t total_files = 0;
+    uint32_t total_skipped = 0;
+    uint64_t total_scanned = 0;
+    for (unsigned int w = 0; w < pool.size(); ++w) {
+        flush_output(outputs[w], output_mutex, true);
+        total_matches += matches[w];
+        total_files += matched_files[w];
+        total_skipped += skipped[w];
+        total_scanned += scanned[w];
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+    std::cout << "Matched " << total_matches << " lines in " << total_files << " files, scanning "
+              << total_scanned << " bytes in " << seconds * 1000 << " ms using " << pool.size() << " thread(s)" << std::endl;
+    if (total_skipped > 0) {
+        std::cout << "Skipped " << total_skipped << " password-protected or unreadable files" << std::endl;
+    }
+}
+
+// Scan one file's chain for the pattern and append its matching lines to
+// 'output', counting them in 'matches'. A file whose first block holds a NUL
+// byte is treated as binary and only reported once. A block that fails its
+// checksum makes the file unreadable, as for read: nothing of it is output
+// and false is returned.
+bool FileSystem::grepFile(const DirectoryEntry& entry, const std::string& path, const std::string& pattern, std::string& output, uint32_t& matches) {
+    std::string pending; // Data not yet searched: the current line, or the pattern's overlap for binary files
+    uint64_t line_number = 1;
+    size_t output_start = output.size();
+    matches = 0;
+    bool binary = false;
+    uint32_t remaining = entry.getSize();
+    uint16_t block = entry.getStartBlock();
+    for (uint32_t block_index = 0; remaining > 0 && isChainBlock(block); ++block_index) {
+        if (blocks.diskResident() && block_index % READAHEAD_BLOCKS == 0) {
+            prefetchChain(block, std::min(READAHEAD_BLOCKS, (remaining + superblock.block_size - 1) / superblock.block_size));
+        }
+        uint32_t length = std::min(remaining, superblock.block_size);
+        const char* data = blocks.pin(block, false);
+        if (block_checksums[block] != kernels->checksum(data, superblock.block_size)) {
+            blocks.unpin(block);
+            output.resize(output_start);
+            matches = 0;
+            std::cerr << "Error: Checksum mismatch in block " << block << " of " << path << std::endl;
+            return false;
+        }
+        if (block_index == 0) {
+            binary = std::memchr(data, '\0', length) != nullptr;
+        }
+        pending.append(data, length);
+        blocks.unpin(block);
+        remaining -= length;
+        block = fat[block];
+
+        if (binary) {
+            if (find_substring(pending.data(), pending.size(), pattern) < pending.size()) {
+                output += "Binary file " + path + " matches\n";
+                matches = 1;
+                return true;
+            }
+            pending.erase(0, pending.size() - std::min(pending.size(), pattern.size() - 1));
+            continue;
+        }
+
+        // Search the complete lines; the last one may go on in the next block.
+        // Everything before this block's data was left over without a
+        // newline, so only the new data is searched for the last one.
+        size_t complete = pending.size();
+        if (remaining > 0) {
+            complete = 0;
+            for (size_t i = pending.size(); i > pending.size() - length; --i) {
+                if (pending[i - 1] == '\n') {
+                    complete = i;
+                    break;
+                }
+            }
+        }
+        matches += scan_lines(pending.data(), complete, pattern, path, line_number, output);
+        pending.erase(0, complete);
+    }
+    return true;
+}
@@ -0,0 +1,170 @@
+#include "filesystem.h"
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <string>
+#include <stdexcept>
+
+/*
+SNAPSHOTS
+*/
+
+void FileSystem::snapshot(const std::string& name) {
+    if (!checkWritable()) {
+        return;
+    }
+
+    if (name.empty()) {
+        std::cerr << "Error: Snapshot name must not be empty." << std::endl;
+        return;
+    }
+
+    for (const Snapshot& existing : snapshots) {
+        if (existing.name == name) {
+            std::cerr << "Error: Snapshot already exists: " << name << std::endl;
+            return;
+        }
+    }
+
+    // Copy only the metadata; every file takes one more reference on its
+    // chain so later writes and deletes leave the captured blocks alone
+    Snapshot new_snapshot;
+    new_snapshot.name = name;
+    new_snapshot.creation_time = std::time(nullptr);
+    new_snapshot.root = root_directory;
+    retainTree(new_snapshot.root);
+    markShared();
+
+    // The snapshot holds everything up to the current generation
+    superblock.snapshot_generation = superblock.generation;
+    modified = true;
+    new_snapshot.generation = advanceGeneration();
+
+    snapshots.push_back(new_snapshot);
+    std::cout << "Snapshot created: " << name << std::endl;
+}
+
+void FileSystem::list_snapshots() {
+    std::cout << std::left << std::setw(20) << "Name";
+    std::cout << std::setw(12) << "Generation";
+    std::cout << std::setw(10) << "Files";
+    std::cout << std::setw(30) << "Creation Time";
+    std::cout << std::endl;
+
+    for (const Snapshot& snapshot : snapshots) {
+        std::time_t creation_time = snapshot.creation_time;
+        std::string creation_time_str = std::ctime(&creation_time);
+        creation_time_str = creation_time_str.substr(0, creation_time_str.length() - 1); // Remove newline character
+
+        std::cout << std::left << std::setw(20) << snapshot.name;
+        std::cout << std::setw(12) << snapshot.generation;
+        std::cout << std::setw(10) << countFiles(snapshot.root);
+        std::cout << std::setw(30) << creation_time_str;
+        std::cout << std::endl;
+    }
+}
+
+void FileSystem::delete_snapshot(const std::string& name) {
+    if (!checkWritable()) {
+        return;
+    }
+
+    for (auto it = snapshots.begin(); it != snapshots.end(); ++it) {
+        if (it->name == name) {
+            // Chains stop being walked at the first block still referenced by the
+            // live tree or another snapshot, so only blocks unique to this
+            // snapshot are visited and freed
+            releaseTree(it->root);
+            snapshots.erase(it);
+            superblock.snapshot_generation = superblock.generation;
+            modified = true;
+            std::cout << "Snapshot deleted: " << name << std::endl;
+            return;
+        }
+    }
+
+    std::cerr << "Error: Snapshot not found: " << name << std::endl;
+}
+
+bool FileSystem::mount_snapshot(const std::string& name) {
+    for (Snapshot& snapshot : snapshots) {
+        if (snapshot.name == name) {
+            mounted_root = &snapshot.root;
+            read_only = true;
+            return true;
+        }
+    }
+
+    std::cerr << "Error: Snapshot not found: " << name << std::endl;
+    return false;
+}
+
+void FileSystem::retainTree(const DirectoryEntry& directory) {
+    for (const auto& entry : directory.children) {
+        if (is_directory(entry)) {
+            retainTree(entry);
+        } else if (isChainBlock(entry.getStartBlock())) {
+            refcounts[entry.getStartBlock()]++;
+            markBlock(entry.getStartBlock());
+        }
+    }
+}
+
+void FileSystem::releaseTree(const DirectoryEntry& directory) {
+    std::vector<uint16_t> start_blocks;
+    collectChains(directory, start_blocks);
+    releaseChains(start_blocks);
+}
+
+std::string FileSystem::serializeSnapshots() {
+    std::ostringstream oss;
+
+    uint32_t num_snapshots = snapshots.size();
+    oss.write(reinterpret_cast<const char*>(&num_snapshots), sizeof(num_snapshots));
+
+    for (const Snapshot& snapshot : snapshots) {
+        uint32_t name_length = snapshot.name.size();
+        oss.write(reinterpret_cast<const char*>(&name_length), sizeof(name_length));
+        oss.write(snapshot.name.c_str(), name_length);
+
+        std::time_t creation_time = snapshot.creation_time;
+        oss.write(reinterpret_cast<const char*>(&creation_time), sizeof(creation_time));
+
+        uint32_t generation = snapshot.generation;
+        oss.write(reinterpret_cast<const char*>(&generation), sizeof(generation));
+
+        write_directory(oss, snapshot.root);
+    }
+
+    return oss.str();
+}
+
+// Read a serialized snapshot list into 'parsed'. A truncated list throws.
+void FileSystem::deserializeSnapshots(const std::string& payload, std::vector<Snapshot>& parsed) {
+    std::istringstream iss(payload);
+
+    uint32_t num_snapshots = 0;
+    iss.read(reinterpret_cast<char*>(&num_snapshots), sizeof(num_snapshots));
+    if (!iss || num_snapshots > payload.size()) {
+        throw std::runtime_error("Snapshot list is truncated");
+    }
+
+    parsed.resize(num_snapshots);
+    for (Snapshot& snapshot : parsed) {
+        uint32_t name_length;
+        iss.read(reinterpret_cast<char*>(&name_length), sizeof(name_length));
+        if (!iss || name_length > payload.size()) {
+            throw std::runtime_error("Snapshot list is truncated");
+        }
+        snapshot.name.assign(name_length, '\0');
+        iss.read(&snapshot.name[0], name_length);
+
+        iss.read(reinterpret_cast<char*>(&snapshot.creation_time), sizeof(snapshot.creation_time));
+        iss.read(reinterpret_cast<char*>(&snapshot.generation), sizeof(snapshot.generation));
+        if (!iss) {
+            throw std::runtime_error("Snapshot list is truncated");
+        }
+
+        read_directory(iss, snapshot.root);
+    }
+}
@@ -0,0 +1,693 @@
+#include "filesystem.h"
+#include <iostream>
+#include <string>
+#include <vector>
+#include <future>
+#include <algorithm>
+#include <map>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstddef>
+#include "metrics.h"
+#include "utility.h"
+
+/*
+TAR
+tar-in and tar-out move whole trees through POSIX ustar streams, so data
+goes between the image and a pipe without per-file host files. Both sides
+are double buffered: while one buffer is parsed or filled from block data,
+the other is read from or written to the stream on another thread. Only
+regular files and directories are carried. The mode's owner read and write
+bits map onto Permissions and the tar mtime onto the entry timestamps.
+Pax extended headers and GNU long-name headers supply the path (and for pax
+the size and mtime) of the member after them; other metadata members, links
+and devices are skipped. Members are rejected if their path has a ".."
+component, so an archive cannot reach outside the target directory.
+*/
+
+namespace {
+
+const uint32_t TAR_RECORD = 512;
+const size_t TAR_BUFFER_SIZE = 256 * 1024;
+const uint64_t TAR_MAX_HEADER_DATA = 1024 * 1024; // Largest pax or long-name header read
+
+struct UstarHeader {
+    char name[100];
+    char mode[8];
+    char uid[8];
+    char gid[8];
+    char size[12];
+    char mtime[12];
+    char checksum[8];
+    char typeflag;
+    char linkname[100];
+    char magic[6];
+    char version[2];
+    char uname[32];
+    char gname[32];
+    char devmajor[8];
+    char devminor[8];
+    char prefix[155];
+    char padding[12];
+};
+
+static_assert(sizeof(UstarHeader) == TAR_RECORD, "UstarHeader layout changed");
+
+uint64_t parse_octal(const char* field, size_t width) {
+    uint64_t value = 0;
+    size_t i = 0;
+    while (i < width && field[i] == ' ') {
+        i++;
+    }
+    for (; i < width && field[i] >= '0' && field[i] <= '7'; ++i) {
+        value = value * 8 + (field[i] - '0');
+    }
+    return value;
+}
+
+// Right-aligned octal digits followed by a NUL, as ustar writers use
+void format_octal(char* field, size_t width, uint64_t value) {
+    field[width - 1] = '\0';
+    for (size_t i = width - 1; i > 0; --i) {
+        field[i - 1] = '0' + (value & 7);
+        value >>= 3;
+    }
+}
+
+// Header checksum: the byte sum with the checksum field counted as spaces.
+// Some old writers summed signed bytes, so both sums are returned.
+void header_sums(const UstarHeader& header, uint32_t& unsigned_sum, int32_t& signed_sum) {
+    const char* bytes = reinterpret_cast<const char*>(&header);
+    unsigned_sum = 0;
+    signed_sum = 0;
+    for (uint32_t i = 0; i < TAR_RECORD; ++i) {
+        bool in_checksum = i >= offsetof(UstarHeader, checksum) && i < offsetof(UstarHeader, checksum) + sizeof(header.checksum);
+        char byte = in_checksum ? ' ' : bytes[i];
+        unsigned_sum += static_cast<unsigned char>(byte);
+        signed_sum += static_cast<signed char>(byte);
+    }
+}
+
+uint64_t padded_size(uint64_t size) {
+    return (size + TAR_RECORD - 1) / TAR_RECORD * TAR_RECORD;
+}
+
+// Path as stored in a header. Only POSIX ustar headers keep part of the path
+// in the prefix field; GNU headers use that space for other data.
+std::string header_path(const UstarHeader& header) {
+    std::string name(header.name, strnlen(header.name, sizeof(header.name)));
+    if (std::memcmp(header.magic, "ustar", 6) != 0 || header.prefix[0] == '\0') {
+        return name;
+    }
+    return std::string(header.prefix, strnlen(header.prefix, sizeof(header.prefix))) + "/" + name;
+}
+
+// Member path relative to the import directory, with empty and "." components
+// dropped; false if a component is ".."
+bool normalize_member_path(const std::string& path, std::string& normalized) {
+    normalized.clear();
+    for (const std::string& component : split_path(path)) {
+        if (component == "..") {
+            return false;
+        }
+        if (component != ".") {
+            normalized += normalized.empty() ? component : "/" + component;
+        }
+    }
+    return true;
+}
+
+// Records of a pax extended header, each "<length> <key>=<value>\n" with the
+// length counting the whole record; false if the data is malformed
+bool parse_pax_records(const std::string& data, std::map<std::string, std::string>& records) {
+    size_t position = 0;
+    while (position < data.size()) {
+        size_t space = data.find(' ', position);
+        uint64_t length = std::strtoull(data.c_str() + position, nullptr, 10);
+        if (space == std::string::npos || length <= space - position + 1 || length > data.size() - position) {
+            return false;
+        }
+        size_t end = position + length - 1;
+        size_t equals = data.find('=', space + 1);
+        if (equals == std::string::npos || equals > end || data[end] != '\n') {
+            return false;
+        }
+        records[data.substr(space + 1, equals - space - 1)] = data.substr(equals + 1, end - equals - 1);
+        position += length;
+    }
+    return true;
+}
+
+// Split a path over the name and prefix fields; false if it cannot fit
+bool set_header_path(UstarHeader& header, const std::string& path) {
+    if (path.size() <= sizeof(header.name)) {
+        std::memcpy(header.name, path.data(), path.size());
+        return true;
+    }
+    // Split at the last '/' that leaves at most 155 characters before it
+    size_t split = path.rfind('/', sizeof(header.prefix));
+    if (split == std::string::npos || split == 0 || path.size() - split - 1 > sizeof(header.name)) {
+        return false;
+    }
+    std::memcpy(header.prefix, path.data(), split);
+    std::memcpy(header.name, path.data() + split + 1, path.size() - split - 1);
+    return true;
+}
+
+}
+
+
+struct TarSummary {
+    uint32_t files;
+    uint32_t directories;
+    uint32_t skipped;
+    uint64_t bytes;
+};
+
+// Reads a stream through two buffers; the next one is filled on another
+// thread while the caller consumes the current one
+class TarReader {
+    public:
+        explicit TarReader(std::istream& is) : is(is), current(1), filling(0), position(0), length(0) {
+            buffers[0].resize(TAR_BUFFER_SIZE);
+            buffers[1].resize(TAR_BUFFER_SIZE);
+            pending = fill(filling);
+        }
+
+        ~TarReader() {
+            if (pending.valid()) {
+                pending.wait();
+            }
+        }
+
+        // Copy the next 'count' bytes; false if the stream ends first
+        bool read(char* destination, size_t count) {
+            while (count > 0) {
+                if (position == length && !advance()) {
+                    return false;
+                }
+                size_t bytes = std::min(count, length - position);
+                std::memcpy(destination, buffers[current].data() + position, bytes);
+                destination += bytes;
+                position += bytes;
+                count -= bytes;
+            }
+            return true;
+        }
+
+        bool skip(uint64_t count) {
+            while (count > 0) {
+                if (position == length && !advance()) {
+                    return false;
+                }
+                size_t bytes = std::min<uint64_t>(count, length - position);
+                position += bytes;
+                count -= bytes;
+            }
+            return true;
+        }
+
+    private:
+        std::istream& is;
+        std::vector<char> buffers[2];
+        int current;
+        int filling; // Buffer the pending read goes into
+        size_t position;
+        size_t length;
+        std::future<size_t> pending;
+
+        std::future<size_t> fill(int buffer) {
+            return std::async(std::launch::async, [this, buffer]() {
+                is.read(buffers[buffer].data(), TAR_BUFFER_SIZE);
+                return static_cast<size_t>(is.gcount());
+            });
+        }
+
+        // Switch to the buffer just filled and start filling the other one,
+        // unless the stream has ended
+        bool advance() {
+            if (!pending.valid()) {
+                return false;
+            }
+            length = pending.get();
+            position = 0;
+            current = filling;
+            if (length == TAR_BUFFER_SIZE) {
+                filling = 1 - current;
+                pending = fill(filling);
+            }
+            return length > 0;
+        }
+};
+
+// Writes a stream through two buffers; a full buffer is written out on
+// another thread while the caller fills the other one
+class TarWriter {
+    public:
+        explicit TarWriter(std::ostream& os) : os(os), current(0), length(0), failed(false) {
+            buffers[0].resize(TAR_BUFFER_SIZE);
+            buffers[1].resize(TAR_BUFFER_SIZE);
+        }
+
+        ~TarWriter() {
+            if (pending.valid()) {
+                pending.wait();
+            }
+        }
+
+        void write(const char* data, size_t count) {
+            while (count > 0) {
+                size_t bytes = std::min(count, TAR_BUFFER_SIZE - length);
+                std::memcpy(buffers[current].data() + length, data, bytes);
+                length += bytes;
+                data += bytes;
+                count -= bytes;
+                if (length == TAR_BUFFER_SIZE) {
+                    flush();
+                }
+            }
+        }
+
+        // Zero bytes up to the next record boundary after 'size' bytes of data
+        void pad(uint64_t size) {
+            static const char zeros[TAR_RECORD] = {};
+            write(zeros, (TAR_RECORD - size % TAR_RECORD) % TAR_RECORD);
+        }
+
+        // Write out everything buffered; false if the stream failed
+        bool finish() {
+            flush();
+            if (pending.valid()) {
+                failed = !pending.get() || failed;
+            }
+            os.flush();
+            return !failed && os.good();
+        }
+
+    private:
+        std::ostream& os;
+        std::vector<char> buffers[2];
+        int current;
+        size_t length;
+        bool failed;
+        std::future<bool> pending; // Write of the other buffer
+
+        void flush() {
+            if (pending.valid()) {
+                failed = !pending.get() || failed;
+            }
+            if (length == 0) {
+                return;
+            }
+            int buffer = current;
+            size_t bytes = length;
+            pending = std::async(std::launch::async, [this, buffer, bytes]() {
+                os.write(buffers[buffer].data(), bytes);
+                return os.good();
+            });
+            current = 1 - current;
+            length = 0;
+        }
+};
+
+// Write the entry, and for a directory everything below it, as tar members
+// named from 'path'. Returns false if the archive could not be completed.
+bool FileSystem::tarEntry(TarWriter& writer, const DirectoryEntry& entry, const std::string& path, TarSummary& summary) {
+    bool directory = entry.getAttribute() & ATTR_DIRECTORY;
+    if (!directory && (!entry.getPassword().empty() || !entry.getPermissions().read)) {
+        std::cerr << "Skipping password-protected or unreadable file: " << path << std::endl;
+        summary.skipped++;
+        return true;
+    }
+
+    if (!path.empty()) {
+        UstarHeader header = UstarHeader();
+        if (!set_header_path(header, path)) {
+            std::cerr << "Skipping path too long for ustar: " << path << std::endl;
+            summary.skipped++;
+            return true;
+        }
+        Permissions permissions = entry.getPermissions();
+        format_octal(header.mode, sizeof(header.mode), directory ? 0755 : (permissions.read ? 0444 : 0) | (permissions.write ? 0200 : 0));
+        format_octal(header.uid, sizeof(header.uid), 0);
+        format_octal(header.gid, sizeof(header.gid), 0);
+        format_octal(header.size, sizeof(header.size), directory ? 0 : entry.getSize());
+        format_octal(header.mtime, sizeof(header.mtime), std::max<std::time_t>(0, entry.getModificationTime()));
+        header.typeflag = directory ? '5' : '0';
+        std::memcpy(header.magic, "ustar", 6);
+        std::memcpy(header.version, "00", 2);
+        uint32_t sum;
+        int32_t signed_sum;
+        header_sums(header, sum, signed_sum);
+        format_octal(header.checksum, 7, sum);
+        header.checksum[7] = ' ';
+        writer.write(reinterpret_cast<const char*>(&header), TAR_RECORD);
+    }
+
+    if (directory) {
+        if (!path.empty()) {
+            summary.directories++;
+        }
+        for (const auto& child : entry.children) {
+            if (!tarEntry(writer, child, path.empty() ? child.getFilename() : path + "/" + child.getFilename(), summary)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    uint32_t remaining = entry.getSize();
+    uint16_t block = entry.getStartBlock();
+    for (uint32_t block_index = 0; remaining > 0; ++block_index) {
+        if (!isChainBlock(block)) {
+            std::cerr << "Error: Chain of " << path << " ends before its size; run fsck." << std::endl;
+            return false;
+        }
+        if (blocks.diskResident() && block_index % READAHEAD_BLOCKS == 0) {
+            prefetchChain(block, std::min(READAHEAD_BLOCKS, kernels->chain_blocks(remaining, superblock.block_size)));
+        }
+        const char* data = blocks.pin(block, false);
+        if (block_checksums[block] != kernels->checksum(data, superblock.block_size)) {
+            blocks.unpin(block);
+            std::cerr << "Error: Checksum mismatch in block " << block << " of " << path << std::endl;
+            return false;
+        }
+        uint32_t bytes = std::min(remaining, superblock.block_size);
+        writer.write(data, bytes);
+        blocks.unpin(block);
+        count_metric(COUNTER_BYTES_READ, bytes);
+        count_metric(COUNTER_FAT_HOPS);
+        remaining -= bytes;
+        block = fat[block];
+    }
+    writer.pad(entry.getSize());
+    summary.files++;
+    summary.bytes += entry.getSize();
+    return true;
+}
+
+bool FileSystem::tar_out(const std::string& path, std::ostream& os) {
+    DirectoryEntry* entry = findEntry(path);
+    if (entry == nullptr) {
+        std::cerr << "Error: Path not found: " << path << std::endl;
+        return false;
+    }
+
+    // A directory's contents are named relative to it, a file by its name
+    TarSummary summary = TarSummary();
+    TarWriter writer(os);
+    bool complete = tarEntry(writer, *entry, is_directory(*entry) ? "" : entry->getFilename(), summary);
+    if (complete) {
+        static const char end_of_archive[2 * TAR_RECORD] = {};
+        writer.write(end_of_archive, sizeof(end_of_archive));
+    }
+    if (!writer.finish()) {
+        std::cerr << "Error: Unable to write the tar stream." << std::endl;
+        return false;
+    }
+    if (!complete) {
+        return false;
+    }
+
+    // The archive owns standard output, so the summary goes to standard error
+    std::cerr << "Exported " << summary.files << " files and " << summary.directories << " directories ("
+              << summary.bytes << " bytes)";
+    if (summary.skipped > 0) {
+        std::cerr << ", skipped " << summary.skipped;
+    }
+    std::cerr << std::endl;
+    return true;
+}
+
+// Directory for a tar member's parent, created with its own parents where
+// missing. 'path' is the member's full path in the image.
+DirectoryEntry* FileSystem::tarDirectory(const std::string& path, TarSummary& summary) {
+    DirectoryEntry* directory = mounted_root;
+    for (const std::string& component : split_path(path)) {
+        DirectoryEntry* next = nullptr;
+        for (auto& child : directory->children) {
+            if (child.getFilename() == component) {
+                next = &child;
+                break;
+            }
+        }
+        if (next != nullptr && !is_directory(*next)) {
+            std::cerr << "Error: " << component << " in " << path << " is a file, not a directory." << std::endl;
+            return nullptr;
+        }
+        if (next == nullptr) {
+            if (component.size() > MAX_FILENAME_LENGTH) {
+                std::cerr << "Error: Name too long: " << component << std::endl;
+                return nullptr;
+            }
+            DirectoryEntry new_directory;
+            new_directory.setFilename(component);
+            new_directory.setAttribute(ATTR_DIRECTORY);
+            new_directory.setSize(0);
+            new_directory.setStartBlock(FAT_EOC);
+            linkEntry(new_directory);
+            touchEntry(*directory);
+            superblock.num_directories++;
+            directory->children.push_back(new_directory);
+            next = &directory->children.back();
+            summary.directories++;
+        }
+        directory = next;
+    }
+    return directory;
+}
+
+// Read one regular file member into a new chain for 'file', then link it
+// under 'parent' in place of any file of the same name. The old file is
+// only released once the new data is in, so a failed import leaves it
+// intact. Returns false if the stream ends inside the member or the image
+// is full.
+bool FileSystem::tarFile(TarReader& reader, DirectoryEntry& parent, const std::string& parent_path, DirectoryEntry& file) {
+    uint32_t size = file.getSize();
+    if (!allocateBlocksForFile(file, size, allocationGoal(parent))) {
+        return false;
+    }
+
+    uint32_t remaining = size;
+    for (uint16_t block = file.getStartBlock(); remaining > 0; block = fat[block]) {
+        char* data = blocks.pinForOverwrite(block);
+        uint32_t bytes = std::min(remaining, superblock.block_size);
+        bool complete = reader.read(data, bytes);
+        std::fill(data + bytes, data + superblock.block_size, '\0');
+        block_checksums[block] = kernels->checksum(data, superblock.block_size);
+        blocks.unpin(block);
+        if (!complete) {
+            std::cerr << "Error: Tar stream ends inside " << file.getFilename() << std::endl;
+            releaseChain(file.getStartBlock());
+            return false;
+        }
+        count_metric(COUNTER_BYTES_WRITTEN, bytes);
+        count_metric(COUNTER_FAT_HOPS);
+        remaining -= bytes;
+    }
+    if (!reader.skip(padded_size(size) - size)) {
+        std::cerr << "Error: Tar stream ends inside " << file.getFilename() << std::endl;
+        releaseChain(file.getStartBlock());
+        return false;
+    }
+
+    // A member replaces a file of the same name, as tar does
+    auto existing = std::find_if(parent.children.begin(), parent.children.end(),
+                                 [&](const DirectoryEntry& child) { return child.getFilename() == file.getFilename(); });
+    if (existing != parent.children.end()) {
+        int64_t old_size = existing->getSize();
+        deallocateBlocksForFile(*existing);
+        parent.children.erase(existing);
+        superblock.num_files--;
+        adjustDirectorySizes(parent_path, -old_size);
+    }
+
+    linkEntry(file);
+    parent.children.push_back(file);
+    touchEntry(parent);
+    superblock.num_files++;
+    adjustDirectorySizes(parent_path, size);
+    return true;
+}
+
+bool FileSystem::tar_in(const std::string& path, std::istream& is) {
+    if (!checkWritable()) {
+        return false;
+    }
+    DirectoryEntry* target = findDirectory(path);
+    if (target == nullptr) {
+        std::cerr << "Error: Directory not found: " << path << std::endl;
+        return false;
+    }
+    std::string base = path == "/" ? "" : path;
+
+    TarSummary summary = TarSummary();
+    TarReader reader(is);
+    UstarHeader header;
+    bool ended = false;
+    bool failed = false;
+
+    // Set by pax and GNU long-name headers for the member that follows them
+    std::string next_path;
+    bool has_next_size = false;
+    uint64_t next_size = 0;
+    bool has_next_mtime = false;
+    std::time_t next_mtime = 0;
+
+    while (reader.read(reinterpret_cast<char*>(&header), TAR_RECORD)) {
+        // Two zero records end the archive; one is enough to stop at
+        if (header.name[0] == '\0') {
+            ended = true;
+            break;
+        }
+        uint32_t sum;
+        int32_t signed_sum;
+        header_sums(header, sum, signed_sum);
+        uint64_t stored_sum = parse_octal(header.checksum, sizeof(header.checksum));
+        if (stored_sum != sum && static_cast<int64_t>(stored_sum) != signed_sum) {
+            std::cerr << "Error: Bad tar header checksum; is the input a tar archive?" << std::endl;
+            failed = true;
+            break;
+        }
+
+        uint64_t size = parse_octal(header.size, sizeof(header.size));
+        char type = header.typeflag;
+
+        // pax extended headers (x, and g for the whole archive) and GNU long
+        // names (L, and K for link targets) hold metadata, not a member
+        if (type == 'x' || type == 'g' || type == 'L' || type == 'K') {
+            if (size > TAR_MAX_HEADER_DATA) {
+                std::cerr << "Error: Tar extended header of " << size << " bytes is too large." << std::endl;
+                failed = true;
+                break;
+            }
+            std::string data(size, '\0');
+            if (!reader.read(&data[0], size) || !reader.skip(padded_size(size) - size)) {
+                std::cerr << "Error: Tar stream ends inside an extended header." << std::endl;
+                failed = true;
+                break;
+            }
+            if (type == 'L') {
+                next_path = data.substr(0, data.find('\0'));
+            } else if (type == 'x') {
+                std::map<std::string, std::string> records;
+                if (!parse_pax_records(data, records)) {
+                    std::cerr << "Error: Malformed pax extended header." << std::endl;
+                    failed = true;
+                    break;
+                }
+                if (records.count("path")) {
+                    next_path = records["path"];
+                }
+                if (records.count("size")) {
+                    has_next_size = true;
+                    next_size = std::strtoull(records["size"].c_str(), nullptr, 10);
+                }
+                if (records.count("mtime")) {
+                    has_next_mtime = true;
+                    next_mtime = std::strtoll(records["mtime"].c_str(), nullptr, 10);
+                }
+            }
+            continue;
+        }
+
+        std::string stored_path = next_path.empty() ? header_path(header) : next_path;
+        if (has_next_size) {
+            size = next_size;
+        }
+        std::time_t mtime = has_next_mtime ? next_mtime : static_cast<std::time_t>(parse_octal(header.mtime, sizeof(header.mtime)));
+        next_path.clear();
+        has_next_size = false;
+        has_next_mtime = false;
+
+        // Contiguous files (7) are plain files to every reader but their
+        // writer. Links, devices, FIFOs and directories carry no data.
+        bool is_file = type == '0' || type == '\0' || type == '7';
+        bool is_dir = type == '5';
+        if (type >= '1' && type <= '6') {
+            size = 0;
+        }
+
+        std::string member;
+        bool safe = normalize_member_path(stored_path, member);
+        if (!safe || member.empty() || (!is_file && !is_dir)) {
+            if (!safe) {
+                std::cerr << "Skipping tar member with '..' in its path: " << stored_path << std::endl;
+                summary.skipped++;
+            } else if (!member.empty()) {
+                std::cerr << "Skipping unsupported tar member: " << member << std::endl;
+                summary.skipped++;
+            }
+            if (!reader.skip(padded_size(size))) {
+                std::cerr << "Error: Tar stream ends inside " << stored_path << std::endl;
+                failed = true;
+                break;
+            }
+            continue;
+        }
+
+        uint64_t mode = parse_octal(header.mode, sizeof(header.mode));
+        std::string full_path = base + "/" + member;
+
+        if (is_dir) {
+            DirectoryEntry* directory = tarDirectory(full_path, summary);
+            if (directory == nullptr) {
+                failed = true;
+                break;
+            }
+            directory->setCreationTime(mtime);
+            directory->setModificationTime(mtime);
+            touchEntry(*directory);
+            continue;
+        }
+
+        std::string parent_path = extract_directory_path(full_path);
+        std::string name = extract_filename(full_path);
+        if (name.size() > MAX_FILENAME_LENGTH || size > static_cast<uint64_t>(superblock.total_blocks) * superblock.block_size) {
+            std::cerr << "Error: Cannot import " << member << ": name or size too large." << std::endl;
+            failed = true;
+            break;
+        }
+        DirectoryEntry* parent = tarDirectory(parent_path, summary);
+        if (parent == nullptr) {
+            failed = true;
+            break;
+        }
+        for (const auto& child : parent->children) {
+            if (child.getFilename() == name && is_directory(child)) {
+                std::cerr << "Error: Cannot replace directory " << full_path << " with a file." << std::endl;
+                failed = true;
+                break;
+            }
+        }
+        if (failed) {
+            break;
+        }
+
+        DirectoryEntry file;
+        file.setFilename(name);
+        file.setSize(size);
+        file.setPermissions({(mode & 0400) != 0, (mode & 0200) != 0});
+        file.setCreationTime(mtime);
+        file.setModificationTime(mtime);
+        if (!tarFile(reader, *parent, parent_path, file)) {
+            failed = true;
+            break;
+        }
+        summary.files++;
+        summary.bytes += size;
+    }
+
+    std::cout << "Imported " << summary.files << " files and created " << summary.directories << " directories ("
+              << summary.bytes << " bytes)";
+    if (summary.skipped > 0) {
+        std::cout << ", skipped " << summary.skipped;
+    }
+    std::cout << std::endl;
+    if (!failed && !ended) {
+        std::cerr << "Error: Tar stream ended without an end-of-archive marker." << std::endl;
+        failed = true;
+    }
+    return !failed;
+}
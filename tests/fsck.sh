@@ -0,0 +1,68 @@
+#!/bin/sh
+# Breaks chains in an image by editing its FAT, then checks that fsck -r
+# repairs them for good: a second fsck must report a clean file system.
+# Run from the repository root after make.
+set -u
+
+ROOT=$(pwd)
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+failures=0
+
+fail() {
+    echo "FAIL: $1"
+    failures=$((failures + 1))
+}
+
+fs() {
+    "$ROOT/fileSystemOper" "$WORK/fs.data" "$@"
+}
+
+# Set FAT entry $1 to the 16-bit value $2 (octal escapes, little endian).
+# The FAT follows the 36-byte superblock and its 4-byte entry count.
+set_fat() {
+    printf "$2" | dd of=fs.data bs=1 seek=$((40 + 2 * $1)) conv=notrunc 2> /dev/null
+}
+
+start_block() {
+    fs dumpe2fs | sed -n "s/^Block: \([0-9]*\), Filename: $1\$/\1/p" | head -n 1
+}
+
+cd "$WORK" || exit 1
+"$ROOT/makeFileSystem" 1 fs.data > /dev/null || exit 1
+echo a > a.txt
+head -c 5000 /dev/urandom > b.bin
+fs write /a a.txt > /dev/null
+fs write /b b.bin > /dev/null
+fs write /c b.bin > /dev/null
+fs checkpoint > /dev/null
+
+# /a: start block freed (dangling); /b: chain cut after its first block
+# (truncated); /c: second block linked back to the first (cyclic)
+a=$(start_block a)
+b=$(start_block b)
+c=$(start_block c)
+[ -n "$a" ] && [ -n "$b" ] && [ -n "$c" ] || { echo "FAIL: no start blocks in dumpe2fs"; exit 1; }
+set_fat "$a" '\377\377'
+set_fat "$b" '\000\000'
+c_next=$(od -An -tu2 -j $((40 + 2 * c)) -N2 fs.data | tr -d ' ')
+set_fat "$c_next" "$(printf '\\%03o\\%03o' $((c % 256)) $((c / 256)))"
+
+fs fsck > before.txt
+grep -q "/a: dangling start block" before.txt || fail "dangling start block not reported"
+grep -q "/b: truncated chain" before.txt || fail "truncated chain not reported"
+grep -q "/c: cyclic chain" before.txt || fail "cyclic chain not reported"
+
+fs fsck -r > /dev/null
+fs fsck > after.txt
+grep -q "File system is clean." after.txt || { fail "fsck after fsck -r is not clean"; cat after.txt; }
+
+# Repaired files stay usable
+fs append /a a.txt > /dev/null
+fs read /a out.txt > /dev/null && cmp -s out.txt a.txt || fail "append to the emptied file failed"
+fs fsck | grep -q "File system is clean." || fail "fsck after append is not clean"
+
+if [ $failures -ne 0 ]; then
+    exit 1
+fi
+echo "fsck: all checks passed"
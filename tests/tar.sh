@@ -0,0 +1,64 @@
+#!/bin/sh
+# Round-trips archives written by the host's GNU tar, in GNU and pax format,
+# through tar-in and tar-out, and checks that unsafe or truncated archives
+# fail without damaging the image. Run from the repository root after make.
+set -u
+
+ROOT=$(pwd)
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+failures=0
+
+fail() {
+    echo "FAIL: $1"
+    failures=$((failures + 1))
+}
+
+fs() {
+    "$ROOT/fileSystemOper" "$WORK/fs.data" "$@"
+}
+
+cd "$WORK" || exit 1
+"$ROOT/makeFileSystem" 1 fs.data > /dev/null || exit 1
+
+# Paths past the 100 characters of a ustar name field need a GNU long-name
+# header or a pax path record
+LONG=src/$(printf 'd%.0s' $(seq 60))/$(printf 'e%.0s' $(seq 60))
+mkdir -p "$LONG" src/empty
+head -c 5000 /dev/urandom > "$LONG/$(printf 'f%.0s' $(seq 50)).bin"
+echo top > src/top.txt
+ln -s top.txt src/link
+
+for format in gnu pax; do
+    tar -C src --format=$format -cf $format.tar . || exit 1
+    fs mkdir /$format > /dev/null
+    fs tar-in /$format < $format.tar > /dev/null 2>&1 || fail "$format: tar-in failed"
+    mkdir out_$format
+    fs tar-out /$format 2> /dev/null | tar -C out_$format -xf - || fail "$format: tar-out failed"
+    rm src/link
+    diff -r src out_$format > /dev/null || fail "$format: exported tree differs"
+    ln -s top.txt src/link
+done
+
+# ".." components are rejected and "." components dropped
+tar -cf dotdot.tar --transform 's,^src/,a/../../,' src/top.txt 2> /dev/null
+fs tar-in / < dotdot.tar > /dev/null 2>&1
+fs dir / | grep -Eq '^(a|top\.txt) ' && fail "member with .. was imported"
+tar -cf dots.tar --transform 's,^src/,./c/./,' src/top.txt
+fs tar-in / < dots.tar > /dev/null 2>&1 || fail "tar-in of ./c/./top.txt failed"
+fs read /c/top.txt c.txt > /dev/null && cmp -s c.txt src/top.txt || fail "./c/./top.txt not imported as /c/top.txt"
+
+# A truncated member fails and leaves the file it would replace intact
+head -c 300000 /dev/urandom > top.txt
+tar -cf replace.tar top.txt
+head -c 100000 replace.tar > truncated.tar
+fs tar-in /gnu < truncated.tar > /dev/null 2>&1 && fail "truncated archive did not fail"
+fs read /gnu/top.txt old.txt > /dev/null && cmp -s old.txt src/top.txt || fail "truncated archive damaged the old file"
+head -c 2048 /dev/urandom | fs tar-in /gnu > /dev/null 2>&1 && fail "garbage input did not fail"
+
+fs fsck | grep -q "File system is clean." || fail "fsck found errors"
+
+if [ $failures -ne 0 ]; then
+    exit 1
+fi
+echo "tar: all checks passed"
@@ -0,0 +1,103 @@
+#include "trace.h"
+#include <fstream>
+#include <chrono>
+#include <cstddef>
+#include <type_traits>
+
+namespace {
+
+std::ofstream trace_stream;
+
+// Integers go byte by byte, least significant first, whatever the host order
+template <typename T>
+void write_value(std::ostream& os, T value) {
+    typedef typename std::make_unsigned<T>::type Bits;
+    Bits bits = static_cast<Bits>(value);
+    char bytes[sizeof(T)];
+    for (size_t i = 0; i < sizeof(T); ++i) {
+        bytes[i] = static_cast<char>(bits >> (8 * i));
+    }
+    os.write(bytes, sizeof(T));
+}
+
+template <typename T>
+bool read_value(std::istream& is, T& value) {
+    typedef typename std::make_unsigned<T>::type Bits;
+    unsigned char bytes[sizeof(T)];
+    if (!is.read(reinterpret_cast<char*>(bytes), sizeof(T))) {
+        return false;
+    }
+    Bits bits = 0;
+    for (size_t i = sizeof(T); i-- > 0;) {
+        bits = static_cast<Bits>((bits << 8) | bytes[i]);
+    }
+    value = static_cast<T>(bits);
+    return true;
+}
+
+}
+
+
+bool open_trace(const std::string& trace_file) {
+    std::ifstream existing(trace_file, std::ios::binary | std::ios::ate);
+    bool is_new = !existing.is_open() || existing.tellg() == 0;
+    existing.close();
+    trace_stream.open(trace_file, std::ios::binary | std::ios::app);
+    if (!trace_stream.is_open()) {
+        return false;
+    }
+    if (is_new) {
+        write_value<uint32_t>(trace_stream, TRACE_MAGIC);
+        write_value<uint32_t>(trace_stream, TRACE_VERSION);
+    }
+    return static_cast<bool>(trace_stream);
+}
+
+bool tracing() {
+    return trace_stream.is_open();
+}
+
+// Records are flushed one at a time, so a crash loses at most the last one
+void trace_operation(const TraceRecord& record) {
+    write_value<uint64_t>(trace_stream, record.start_ns);
+    write_value<uint64_t>(trace_stream, record.duration_ns);
+    write_value<uint64_t>(trace_stream, record.data_size);
+    write_value<int32_t>(trace_stream, record.status);
+    write_value<uint8_t>(trace_stream, record.args.size());
+    for (const std::string& arg : record.args) {
+        write_value<uint16_t>(trace_stream, arg.size());
+        trace_stream.write(arg.data(), arg.size());
+    }
+    trace_stream.flush();
+}
+
+uint64_t trace_clock() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+bool read_trace_header(std::istream& is) {
+    uint32_t magic;
+    uint32_t version;
+    return read_value(is, magic) && read_value(is, version) && magic == TRACE_MAGIC && version == TRACE_VERSION;
+}
+
+bool read_trace_record(std::istream& is, TraceRecord& record) {
+    uint8_t num_args;
+    if (!read_value(is, record.start_ns) || !read_value(is, record.duration_ns) || !read_value(is, record.data_size) ||
+        !read_value(is, record.status) || !read_value(is, num_args)) {
+        return false;
+    }
+
+    record.args.assign(num_args, std::string());
+    for (std::string& arg : record.args) {
+        uint16_t length;
+        if (!read_value(is, length)) {
+            return false;
+        }
+        arg.assign(length, '\0');
+        if (length > 0 && !is.read(&arg[0], length)) {
+            return false;
+        }
+    }
+    return true;
+}
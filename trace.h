@@ -0,0 +1,35 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <cstdint>
+#include <istream>
+#include <string>
+#include <vector>
+
+// Operation traces: a header <magic, version> followed by one record per
+// operation, appended as it completes. All integers are little endian.
+//   uint64 start (ns since the epoch), uint64 duration (ns),
+//   uint64 data size (bytes of the host file written or read), int32 status,
+//   uint8 argument count, then each argument as <uint16 length, bytes>
+const uint32_t TRACE_MAGIC = 0x52545346; // "FSTR"
+const uint32_t TRACE_VERSION = 1;
+
+struct TraceRecord {
+    uint64_t start_ns;
+    uint64_t duration_ns;
+    uint64_t data_size;
+    int32_t status;
+    std::vector<std::string> args; // args[0] is the operation name
+};
+
+// Open the trace file for appending; writes the header if the file is new
+bool open_trace(const std::string& trace_file);
+bool tracing();
+void trace_operation(const TraceRecord& record);
+uint64_t trace_clock();
+
+// Check the header, then read records one at a time
+bool read_trace_header(std::istream& is);
+bool read_trace_record(std::istream& is, TraceRecord& record);
+
+#endif
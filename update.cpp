@@ -0,0 +1,270 @@
+#include "filesystem.h"
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include "metrics.h"
+#include "utility.h"
+
+/*
+IN-PLACE UPDATES
+overwrite, append and truncate change an existing file through its current
+chain rather than deleting and rewriting it. Blocks shared with a copy or a
+snapshot are made private with unshareBlock only where the chain is modified,
+new blocks are allocated right after the last one, and shrinking frees only
+the cut-off suffix. Once an entry's chain is known to be private, its last
+block is cached in the entry, so an append goes straight to the tail. The
+cache is dropped when the start block changes and whenever share_epoch
+advances (cp, snapshot, apply-delta, fsck repair), since blocks may have
+become shared behind the entry. Valid tails are stored in the image and in
+journal records, so appends in later runs skip the walk as well.
+*/
+
+// The file at 'path' if the caller may modify it, after the password check
+DirectoryEntry* FileSystem::findWritableFile(const std::string& path) {
+    DirectoryEntry* entry = findEntry(path);
+    if (entry == nullptr || is_directory(*entry)) {
+        std::cerr << "Error: File not found: " << path << std::endl;
+        return nullptr;
+    }
+    if (!checkPassword(*entry)) {
+        std::cerr << "Error: Incorrect password." << std::endl;
+        return nullptr;
+    }
+    if (!entry->getPermissions().write) {
+        std::cerr << "Error: File do not have a permission for writing: " << entry->getFilename() << std::endl;
+        return nullptr;
+    }
+    return entry;
+}
+
+// Last block of the entry's chain, with the whole chain made private so the
+// tail can be rewritten and extended. Returns FAT_FREE if the entry has no
+// chain or the shared part cannot be copied.
+uint16_t FileSystem::privateTail(DirectoryEntry& entry) {
+    uint16_t tail = entry.getTailBlock();
+    if (entry.getTailEpoch() == share_epoch && isChainBlock(tail) && fat[tail] == FAT_EOC) {
+        return tail;
+    }
+
+    uint32_t length = 0;
+    bool shared = false;
+    uint16_t block = entry.getStartBlock();
+    while (isChainBlock(block) && length < fat.size()) {
+        shared = shared || refcounts[block] > 1;
+        tail = block;
+        block = fat[block];
+        length++;
+        count_metric(COUNTER_FAT_HOPS);
+    }
+    if (length == 0) {
+        return FAT_FREE;
+    }
+    if (shared) {
+        tail = unshareBlock(entry, length - 1);
+    }
+    if (tail != FAT_FREE) {
+        entry.setTail(tail, share_epoch);
+    }
+    return tail;
+}
+
+// Allocate 'count' blocks near the private block 'tail' and link them after
+// it. Nothing changes if the image cannot hold them.
+bool FileSystem::extendChain(uint16_t tail, uint32_t count, std::vector<uint16_t>& added) {
+    if (count == 0) {
+        return true;
+    }
+    MetricTimer timer(HISTOGRAM_ALLOCATE);
+    if (!allocateBlocks(count, tail + 1, added)) {
+        std::cerr << "Error: Insufficient free blocks to allocate for file." << std::endl;
+        return false;
+    }
+
+    fat[tail] = added.front();
+    markBlock(tail);
+    for (size_t i = 0; i < added.size(); ++i) {
+        fat[added[i]] = i + 1 < added.size() ? added[i + 1] : FAT_EOC;
+        refcounts[added[i]] = 1;
+    }
+    return true;
+}
+
+// End the chain at the private block 'last' and drop its reference to the
+// rest, which is freed unless a copy or a snapshot still uses it
+void FileSystem::cutChain(uint16_t last) {
+    uint16_t successor = fat[last];
+    if (successor == FAT_EOC) {
+        return;
+    }
+    fat[last] = FAT_EOC;
+    markBlock(last);
+    if (isChainBlock(successor)) {
+        releaseChain(successor);
+    }
+}
+
+// Read 'length' bytes of a host file into the block from 'offset' on and
+// clear the rest of the block
+void FileSystem::fillBlock(uint16_t block, std::istream& is, uint32_t offset, uint32_t length) {
+    char* data = offset == 0 ? blocks.pinForOverwrite(block) : blocks.pin(block, true);
+    is.read(data + offset, length);
+    std::fill(data + offset + length, data + superblock.block_size, '\0');
+    block_checksums[block] = kernels->checksum(data, superblock.block_size);
+    blocks.unpin(block);
+    markBlock(block);
+    count_metric(COUNTER_BYTES_WRITTEN, length);
+}
+
+void FileSystem::overwrite(const std::string& path, const std::string& linux_file) {
+    if (!checkWritable()) {
+        return;
+    }
+    DirectoryEntry* entry = findWritableFile(path);
+    if (entry == nullptr) {
+        return;
+    }
+
+    std::ifstream linux_ifs(linux_file, std::ios::in | std::ios::binary | std::ios::ate);
+    if (!linux_ifs.is_open()) {
+        std::cerr << "Error: Unable to open Linux file." << std::endl;
+        return;
+    }
+    uint64_t new_size = linux_ifs.tellg();
+    linux_ifs.seekg(0);
+    if (new_size > static_cast<uint64_t>(superblock.total_blocks) * superblock.block_size) {
+        std::cerr << "Error: Insufficient free blocks to allocate for file." << std::endl;
+        return;
+    }
+
+    // A chain cut away by fsck starts over with a single block
+    if (!isChainBlock(entry->getStartBlock()) && !allocateBlocksForFile(*entry, 0, 1)) {
+        return;
+    }
+
+    uint32_t length = 0;
+    for (uint16_t block = entry->getStartBlock(); isChainBlock(block) && length < fat.size(); block = fat[block]) {
+        length++;
+        count_metric(COUNTER_FAT_HOPS);
+    }
+
+    // Only the blocks that are rewritten need to be private
+    uint32_t new_blocks = kernels->chain_blocks(new_size, superblock.block_size);
+    uint16_t last = unshareBlock(*entry, std::min(length, new_blocks) - 1);
+    if (last == FAT_FREE) {
+        return;
+    }
+    std::vector<uint16_t> added;
+    if (new_blocks > length && !extendChain(last, new_blocks - length, added)) {
+        return;
+    }
+    if (new_blocks < length) {
+        cutChain(last);
+    }
+
+    // An empty file still clears its one block
+    if (new_size == 0) {
+        fillBlock(last, linux_ifs, 0, 0);
+    } else {
+        count_metric(COUNTER_FAT_HOPS, kernels->fill_chain(chainState(), entry->getStartBlock(), linux_ifs, new_size, superblock.block_size));
+        count_metric(COUNTER_BYTES_WRITTEN, new_size);
+    }
+
+    int64_t delta = static_cast<int64_t>(new_size) - entry->getSize();
+    entry->setSize(new_size);
+    entry->setModificationTime(std::time(nullptr));
+    entry->setTail(added.empty() ? last : added.back(), share_epoch);
+    touchEntry(*entry);
+    adjustDirectorySizes(extract_directory_path(path), delta);
+}
+
+void FileSystem::append(const std::string& path, const std::string& linux_file) {
+    if (!checkWritable()) {
+        return;
+    }
+    DirectoryEntry* entry = findWritableFile(path);
+    if (entry == nullptr) {
+        return;
+    }
+
+    std::ifstream linux_ifs(linux_file, std::ios::in | std::ios::binary | std::ios::ate);
+    if (!linux_ifs.is_open()) {
+        std::cerr << "Error: Unable to open Linux file." << std::endl;
+        return;
+    }
+    uint64_t length = linux_ifs.tellg();
+    linux_ifs.seekg(0);
+    uint32_t size = entry->getSize();
+    if (size + length > static_cast<uint64_t>(superblock.total_blocks) * superblock.block_size) {
+        std::cerr << "Error: Insufficient free blocks to allocate for file." << std::endl;
+        return;
+    }
+
+    if (!isChainBlock(entry->getStartBlock()) && !allocateBlocksForFile(*entry, 0, 1)) {
+        return;
+    }
+    uint16_t tail = privateTail(*entry);
+    if (tail == FAT_FREE) {
+        return;
+    }
+
+    // Fill the free space of the last block, then continue in new blocks
+    uint32_t tail_offset = size - (kernels->chain_blocks(size, superblock.block_size) - 1) * superblock.block_size;
+    uint32_t in_tail = std::min<uint64_t>(length, superblock.block_size - tail_offset);
+    std::vector<uint16_t> added;
+    if (!extendChain(tail, kernels->chain_blocks(size + length, superblock.block_size) - kernels->chain_blocks(size, superblock.block_size), added)) {
+        return;
+    }
+    if (in_tail > 0) {
+        fillBlock(tail, linux_ifs, tail_offset, in_tail);
+    }
+    if (!added.empty()) {
+        count_metric(COUNTER_FAT_HOPS, kernels->fill_chain(chainState(), added.front(), linux_ifs, length - in_tail, superblock.block_size));
+        count_metric(COUNTER_BYTES_WRITTEN, length - in_tail);
+    }
+
+    entry->setSize(size + length);
+    entry->setModificationTime(std::time(nullptr));
+    entry->setTail(added.empty() ? tail : added.back(), share_epoch);
+    touchEntry(*entry);
+    adjustDirectorySizes(extract_directory_path(path), length);
+}
+
+void FileSystem::fs_truncate(const std::string& path, uint32_t new_size) {
+    if (!checkWritable()) {
+        return;
+    }
+    DirectoryEntry* entry = findWritableFile(path);
+    if (entry == nullptr) {
+        return;
+    }
+    uint32_t size = entry->getSize();
+    if (new_size > size) {
+        std::cerr << "Error: File is only " << size << " bytes; truncate cannot make it larger." << std::endl;
+        return;
+    }
+
+    // The block that becomes the last one is only rewritten if the chain
+    // goes on past it. Bytes after the new size stay in that block; readers
+    // stop at the size and append overwrites them.
+    uint32_t last_index = kernels->chain_blocks(new_size, superblock.block_size) - 1;
+    uint16_t block = entry->getStartBlock();
+    for (uint32_t i = 0; i < last_index && isChainBlock(block); ++i) {
+        block = fat[block];
+        count_metric(COUNTER_FAT_HOPS);
+    }
+    if (isChainBlock(block) && isChainBlock(fat[block])) {
+        uint16_t last = unshareBlock(*entry, last_index);
+        if (last == FAT_FREE) {
+            return;
+        }
+        cutChain(last);
+        entry->setTail(last, share_epoch);
+    }
+
+    entry->setSize(new_size);
+    entry->setModificationTime(std::time(nullptr));
+    touchEntry(*entry);
+    adjustDirectorySizes(extract_directory_path(path), static_cast<int64_t>(new_size) - size);
+}
@@ -1,4 +1,8 @@
 #include "utility.h"
+#include <cstdio>
+#include <stdexcept>
+#include <fcntl.h>
+#include <unistd.h>
 
 std::string extract_filename(const std::string& path) {
     size_t last_slash_pos = path.find_last_of('/');
@@ -20,3 +24,66 @@ std::string extract_directory_path(const std::string& path) {
     return path.substr(0, last_slash_pos);
 }
 
+std::vector<std::string> split_path(const std::string& path) {
+    std::vector<std::string> components;
+    size_t start = 0;
+    while (start <= path.size()) {
+        size_t slash_pos = path.find('/', start);
+        if (slash_pos == std::string::npos) {
+            slash_pos = path.size();
+        }
+        if (slash_pos > start) {
+            components.push_back(path.substr(start, slash_pos - start));
+        }
+        start = slash_pos + 1;
+    }
+    return components;
+}
+
+// Flush a fully written temporary file to disk and move it over 'path', so
+// readers see either the old or the new contents, never a mix
+void sync_and_rename(const std::string& temp_path, const std::string& path) {
+    int fd = open(temp_path.c_str(), O_RDONLY);
+    if (fd < 0 || fsync(fd) != 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        throw std::runtime_error("Failed to flush " + temp_path);
+    }
+    close(fd);
+
+    if (std::rename(temp_path.c_str(), path.c_str()) != 0) {
+        throw std::runtime_error("Failed to replace " + path);
+    }
+}
+
+bool parse_number(const std::string& text, uint32_t& value) {
+    if (text.empty() || text.size() > 10) {
+        return false;
+    }
+    uint64_t result = 0;
+    for (char c : text) {
+        if (c < '0' || c > '9') {
+            return false;
+        }
+        result = result * 10 + (c - '0');
+    }
+    if (result > UINT32_MAX) {
+        return false;
+    }
+    value = static_cast<uint32_t>(result);
+    return true;
+}
+
+bool parse_block_size(const std::string& text, uint32_t& block_size) {
+    uint32_t kb = 0;
+    if (text == "0.5") {
+        block_size = 512;
+        return true;
+    }
+    if (!parse_number(text, kb) || kb != 1) {
+        return false;
+    }
+    block_size = 1024;
+    return true;
+}
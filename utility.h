@@ -2,9 +2,17 @@
 #define UTILITY_H
 
 #include <string>
+#include <vector>
+#include <cstdint>
 
 
 std::string extract_filename(const std::string& path);
 std::string extract_directory_path(const std::string& path);
+std::vector<std::string> split_path(const std::string& path);
+void sync_and_rename(const std::string& temp_path, const std::string& path);
+// Parse a command line count: decimal digits only, at most UINT32_MAX
+bool parse_number(const std::string& text, uint32_t& value);
+// Parse a block size given in KB, "0.5" or "1", into bytes
+bool parse_block_size(const std::string& text, uint32_t& block_size);
 
 #endif 
\ No newline at end of file
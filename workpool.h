@@ -0,0 +1,98 @@
+#ifndef WORKPOOL_H
+#define WORKPOOL_H
+
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Runs a set of tasks, and every task they spawn, on a fixed number of
+// threads. Each thread has its own deque: it pushes and pops its own work
+// at the back, so a subtree stays on the thread that found it, and when its
+// deque runs dry it steals from the front of another thread's deque, where
+// the oldest and usually largest pieces of work are.
+template <typename Task>
+class WorkStealingPool {
+    public:
+        explicit WorkStealingPool(unsigned int num_threads) : pending(0) {
+            for (unsigned int i = 0; i < std::max(1u, num_threads); ++i) {
+                queues.emplace_back(new Queue());
+            }
+        }
+
+        unsigned int size() const { return queues.size(); }
+
+        // Queue a task on the given worker's deque. Callable from inside
+        // process for the worker running it.
+        void push(unsigned int worker, Task task) {
+            pending++;
+            std::lock_guard<std::mutex> lock(queues[worker]->mutex);
+            queues[worker]->tasks.push_back(std::move(task));
+        }
+
+        // Call process(worker, task) for every task until none are left.
+        // The initial tasks are dealt out round robin.
+        template <typename Process>
+        void run(std::vector<Task> initial, Process process) {
+            for (size_t i = 0; i < initial.size(); ++i) {
+                push(i % queues.size(), std::move(initial[i]));
+            }
+
+            std::vector<std::thread> workers;
+            for (unsigned int w = 0; w < queues.size(); ++w) {
+                workers.push_back(std::thread([this, w, &process]() {
+                    Task task;
+                    // A task is counted until it finishes, after any it spawns
+                    // were pushed, so pending only reaches zero once all is done
+                    while (pending.load() > 0) {
+                        if (popOwn(w, task) || steal(w, task)) {
+                            process(w, task);
+                            pending--;
+                        } else {
+                            std::this_thread::yield();
+                        }
+                    }
+                }));
+            }
+            for (std::thread& worker : workers) {
+                worker.join();
+            }
+        }
+
+    private:
+        struct Queue {
+            std::mutex mutex;
+            std::deque<Task> tasks;
+        };
+
+        std::vector<std::unique_ptr<Queue>> queues;
+        std::atomic<size_t> pending; // Tasks queued or running
+
+        bool popOwn(unsigned int worker, Task& task) {
+            std::lock_guard<std::mutex> lock(queues[worker]->mutex);
+            if (queues[worker]->tasks.empty()) {
+                return false;
+            }
+            task = std::move(queues[worker]->tasks.back());
+            queues[worker]->tasks.pop_back();
+            return true;
+        }
+
+        bool steal(unsigned int thief, Task& task) {
+            for (unsigned int i = 1; i < queues.size(); ++i) {
+                Queue& victim = *queues[(thief + i) % queues.size()];
+                std::lock_guard<std::mutex> lock(victim.mutex);
+                if (!victim.tasks.empty()) {
+                    task = std::move(victim.tasks.front());
+                    victim.tasks.pop_front();
+                    return true;
+                }
+            }
+            return false;
+        }
+};
+
+#endif